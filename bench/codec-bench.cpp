@@ -0,0 +1,166 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Microbenchmarks for the transfer-encoding decoders. Each case is decoded
+// with the scalar code and with the implementation picked for this CPU, the
+// outputs are compared and the throughput of both is reported.
+
+#include "codec.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+typedef bool (*DecodeFn)(const char *in, size_t len, std::string &out);
+
+static double Measure(DecodeFn fn, const std::string &input, std::string &out)
+{
+    // size the run so every case processes roughly 256MB
+    size_t iterations = (256u << 20) / input.length() + 1;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        out.clear();
+        fn(input.data(), input.length(), out);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return (double(input.length()) * iterations) / elapsed.count() / (1024.0 * 1024.0);
+}
+
+static bool Run(const char *name, DecodeFn scalar, DecodeFn fast, const std::string &input)
+{
+    std::string expected, actual;
+    double scalarRate = Measure(scalar, input, expected);
+    double fastRate = Measure(fast, input, actual);
+
+    bool match = (expected == actual);
+    printf("%-28s %10zu bytes  scalar %8.1f MB/s  %s %8.1f MB/s  x%.2f%s\n",
+        name, input.length(), scalarRate, CodecImplementation(), fastRate,
+        fastRate / scalarRate, match ? "" : "  MISMATCH");
+
+    return match;
+}
+
+// decodes 'input' with both implementations and compares with a known answer
+static bool Expect(const char *name, DecodeFn scalar, DecodeFn fast, const std::string &input,
+    const std::string &expected)
+{
+    std::string scalarOut, fastOut;
+    scalar(input.data(), input.length(), scalarOut);
+    fast(input.data(), input.length(), fastOut);
+
+    bool match = (scalarOut == expected && fastOut == expected);
+    if (!match)
+        printf("%-28s WRONG RESULT\n", name);
+
+    return match;
+}
+
+// wraps encoded data at 76 columns the way MIME bodies are
+static std::string Wrap(const std::string &data)
+{
+    std::string wrapped;
+    for (size_t i = 0; i < data.length(); i += 76)
+    {
+        wrapped.append(data, i, 76);
+        wrapped.append("\r\n");
+    }
+
+    return wrapped;
+}
+
+static std::string Random(size_t len)
+{
+    std::string data(len, '\0');
+    for (size_t i = 0; i < len; ++i)
+        data[i] = static_cast<char>(rand() & 0xFF);
+
+    return data;
+}
+
+static std::string Text(size_t len, int escapeEvery)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    std::string text;
+    size_t column = 0;
+    for (size_t i = 0; text.length() < len; ++i)
+    {
+        if (escapeEvery > 0 && (i % escapeEvery) == 0)
+        {
+            unsigned char ch = static_cast<unsigned char>(0xC0 + (i & 0x3F));
+            text.push_back('=');
+            text.push_back(hex[ch >> 4]);
+            text.push_back(hex[ch & 0xF]);
+            column += 3;
+        }
+        else
+        {
+            text.push_back(static_cast<char>('a' + (i % 26)));
+            ++column;
+        }
+
+        if (column >= 72)
+        {
+            text.append("=\r\n");
+            column = 0;
+        }
+    }
+
+    return text;
+}
+
+int main(void)
+{
+    srand(42);
+
+    bool ok = true;
+    const std::string line(64, 'a');
+    ok &= Expect("qp encoded trailing space", QPDecodeScalar, QPDecode, "abc=20\r\n", "abc \r\n");
+    ok &= Expect("qp encoded trailing space 64", QPDecodeScalar, QPDecode, line + "=20\r\n", line + " \r\n");
+    ok &= Expect("qp trailing whitespace", QPDecodeScalar, QPDecode, "abc \t\r\n", "abc\r\n");
+    ok &= Expect("qp soft line break", QPDecodeScalar, QPDecode, "abc=\r\ndef", "abcdef");
+
+    const size_t sizes[] = { 1024, 64 * 1024, 4 * 1024 * 1024 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        std::string encoded;
+        Base64Encode(Random(sizes[i]).data(), sizes[i], encoded);
+
+        char name[64];
+        snprintf(name, sizeof(name), "base64 unwrapped %zuK", sizes[i] / 1024);
+        ok &= Run(name, Base64DecodeScalar, Base64Decode, encoded);
+
+        snprintf(name, sizeof(name), "base64 76 col %zuK", sizes[i] / 1024);
+        ok &= Run(name, Base64DecodeScalar, Base64Decode, Wrap(encoded));
+
+        snprintf(name, sizeof(name), "qp plain text %zuK", sizes[i] / 1024);
+        ok &= Run(name, QPDecodeScalar, QPDecode, Text(sizes[i], 0));
+
+        snprintf(name, sizeof(name), "qp 1/20 escaped %zuK", sizes[i] / 1024);
+        ok &= Run(name, QPDecodeScalar, QPDecode, Text(sizes[i], 20));
+    }
+
+    return (ok ? 0 : 1);
+}
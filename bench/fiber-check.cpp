@@ -0,0 +1,67 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Runs scripts that recurse as deeply as Duktape allows on a fiber with the
+// stack each script gets in the daemon. Every one should end in a
+// RangeError; one that overflows the stack crashes the check instead.
+
+#include "fiber.hpp"
+#include "scriptvm.hpp"
+
+#include <cstdio>
+#include <string>
+
+static const char *s_Scripts[][2] =
+{
+    { "native recursion", "function f(n) { return n ? [1].map(function () { return f(n - 1); }) : 0; } f(100000);" },
+    { "call recursion", "function g(n) { return n ? g(n - 1) + 1 : 0; } g(1000000);" },
+    { "regexp compile", "new RegExp('('.repeat(20000) + ')'.repeat(20000));" },
+    { "regexp execute", "/(a*)*b/.exec('a'.repeat(50000));" },
+    { "json parse", "JSON.parse('['.repeat(100000));" },
+    { "json stringify", "var o = {}; for (var i = 0; i < 100000; i++) o = { a: o }; JSON.stringify(o);" },
+};
+
+static bool Run(const char *name, const char *script)
+{
+    std::string error;
+    Fiber fiber([&]()
+        {
+            duk_context *ctx = duk_create_heap_default();
+            if (duk_peval_string(ctx, script) != 0)
+                error.assign(duk_safe_to_string(ctx, -1));
+            duk_destroy_heap(ctx);
+        }, SCRIPT_STACK_SIZE);
+    fiber.Resume();
+
+    bool ok = (error.compare(0, 10, "RangeError") == 0);
+    printf("%-20s %s%s\n", name, error.empty() ? "no error" : error.c_str(), ok ? "" : "  UNEXPECTED");
+    return ok;
+}
+
+int main(void)
+{
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(s_Scripts) / sizeof(s_Scripts[0]); ++i)
+        ok = Run(s_Scripts[i][0], s_Scripts[i][1]) && ok;
+
+    return ok ? 0 : 1;
+}
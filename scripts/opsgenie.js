@@ -2,10 +2,10 @@ var apiKey = "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx";
 
 function main(email) {
 
-    var json = '{' + "\n"
-        + '"message": "' + email.subject + '",' + "\n"
-        + '"description": "' + email.body + '"' + "\n"
-        + '}';
+    var json = JSON.stringify({
+        message: email.subject,
+        description: email.text || email.body
+    });
 
     var http = new WebRequest();
     http.header("Content-Type", "application/json");
@@ -0,0 +1,88 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "backlog.hpp"
+#include "metrics.hpp"
+#include "spdlog/spdlog.h"
+
+// a throttled backlog is released once it is below this share of its limits
+#define BACKLOG_RESUME_PERCENT  90
+
+Backlog::Backlog(size_t maxMessages, size_t maxBytes)
+    : m_MaxMessages(maxMessages), m_MaxBytes(maxBytes), m_Messages(0), m_Bytes(0), m_Throttled(false),
+    m_MessagesGauge(Metrics::Gauge("smtp_js_http_backlog_messages", "Messages accepted but not yet processed")),
+    m_BytesGauge(Metrics::Gauge("smtp_js_http_backlog_bytes", "Bytes of message data held in memory for the backlog")),
+    m_ThrottledGauge(Metrics::Gauge("smtp_js_http_backlog_throttled", "1 while new mail is being turned away"))
+{
+}
+
+void Backlog::Add(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    m_Messages++;
+    m_Bytes += bytes;
+
+    m_MessagesGauge = static_cast<int64_t>(m_Messages);
+    m_BytesGauge = static_cast<int64_t>(m_Bytes);
+
+    if (!m_Throttled && ((m_MaxMessages > 0 && m_Messages >= m_MaxMessages) ||
+        (m_MaxBytes > 0 && m_Bytes >= m_MaxBytes)))
+    {
+        spdlog::warn("Backlog: {} message(s), {} bytes queued, throttling new mail", m_Messages, m_Bytes);
+        m_Throttled = true;
+        m_ThrottledGauge = 1;
+    }
+}
+
+void Backlog::Remove(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_Messages > 0)
+        m_Messages--;
+    m_Bytes = (m_Bytes > bytes ? m_Bytes - bytes : 0);
+
+    m_MessagesGauge = static_cast<int64_t>(m_Messages);
+    m_BytesGauge = static_cast<int64_t>(m_Bytes);
+
+    if (m_Throttled &&
+        (m_MaxMessages == 0 || m_Messages * 100 < m_MaxMessages * BACKLOG_RESUME_PERCENT) &&
+        (m_MaxBytes == 0 || m_Bytes * 100 < m_MaxBytes * BACKLOG_RESUME_PERCENT))
+    {
+        spdlog::info("Backlog: down to {} message(s), {} bytes, accepting new mail", m_Messages, m_Bytes);
+        m_Throttled = false;
+        m_ThrottledGauge = 0;
+    }
+}
+
+size_t Backlog::Messages(void)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Messages;
+}
+
+size_t Backlog::Bytes(void)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Bytes;
+}
@@ -0,0 +1,61 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Messages that have been accepted but not processed yet, whether they are
+// waiting for the journal or for a worker. Once either limit is reached the
+// backlog is throttled, and it stays that way until it has dropped back
+// below BACKLOG_RESUME_PERCENT of both, so ingest doesn't flap at the edge.
+// Only message data held in memory counts towards the byte limit, spooled
+// messages are on disk.
+class Backlog
+{
+private:
+    size_t m_MaxMessages;       // 0 for no limit
+    size_t m_MaxBytes;
+
+    std::mutex m_Mutex;
+    size_t m_Messages;
+    size_t m_Bytes;
+    std::atomic_bool m_Throttled;
+
+    std::atomic<int64_t> &m_MessagesGauge;
+    std::atomic<int64_t> &m_BytesGauge;
+    std::atomic<int64_t> &m_ThrottledGauge;
+
+public:
+    Backlog(size_t maxMessages, size_t maxBytes);
+
+    void Add(size_t bytes);
+    void Remove(size_t bytes);
+
+    bool IsThrottled(void) const { return m_Throttled; }
+
+    size_t Messages(void);
+    size_t Bytes(void);
+};
@@ -0,0 +1,150 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "breaker.hpp"
+#include "metrics.hpp"
+#include "spdlog/spdlog.h"
+
+Breakers::Breakers(const BreakerOptions &options)
+    : m_Options(options)
+{
+    if (m_Options.requests == 0)
+        m_Options.requests = 1;
+}
+
+Breakers::Host& Breakers::Find(const std::string &name)
+{
+    std::map<std::string, Host>::iterator i = m_Hosts.find(name);
+    if (i != m_Hosts.end())
+        return i->second;
+
+    Host &host = m_Hosts[name];
+    host.state = STATE_CLOSED;
+    host.outcomes.assign(m_Options.requests, false);
+    host.next = 0;
+    host.count = 0;
+    host.bad = 0;
+    host.probing = false;
+
+    std::string labels = "{host=\"" + Metrics::Label(name) + "\"}";
+    host.stateGauge = &Metrics::Gauge("smtp_js_http_http_breaker_state" + labels,
+        "Circuit breaker of each host: 0 closed, 1 open, 2 half-open");
+    host.opened = &Metrics::Counter("smtp_js_http_http_breaker_opened_total" + labels,
+        "Times the circuit breaker of each host opened");
+    host.rejected = &Metrics::Counter("smtp_js_http_http_breaker_rejected_total" + labels,
+        "Web requests failed straight away because their host's breaker was open");
+
+    return host;
+}
+
+void Breakers::SetState(Host &host, State state)
+{
+    host.state = state;
+    host.stateGauge->store(state);
+
+    if (state == STATE_OPEN)
+    {
+        host.until = std::chrono::steady_clock::now() + m_Options.open;
+        host.probing = false;
+        (*host.opened)++;
+    }
+    else if (state == STATE_CLOSED)
+    {
+        host.outcomes.assign(m_Options.requests, false);
+        host.next = 0;
+        host.count = 0;
+        host.bad = 0;
+        host.probing = false;
+    }
+}
+
+bool Breakers::Allow(const std::string &name)
+{
+    std::unique_lock<std::mutex> guard(m_Mutex);
+    Host &host = Find(name);
+
+    if (host.state == STATE_OPEN && std::chrono::steady_clock::now() >= host.until)
+    {
+        spdlog::info("Breaker: {} is half-open, trying a request", name.c_str());
+        SetState(host, STATE_HALF_OPEN);
+    }
+
+    // one request at a time finds out whether the host is back
+    if (host.state == STATE_HALF_OPEN && !host.probing)
+    {
+        host.probing = true;
+        return true;
+    }
+
+    if (host.state == STATE_CLOSED)
+        return true;
+
+    (*host.rejected)++;
+    return false;
+}
+
+void Breakers::Record(const std::string &name, bool bad, std::chrono::milliseconds latency)
+{
+    if (m_Options.slow.count() > 0 && latency > m_Options.slow)
+        bad = true;
+
+    std::unique_lock<std::mutex> guard(m_Mutex);
+    Host &host = Find(name);
+
+    switch (host.state)
+    {
+        case STATE_CLOSED:
+            if (host.count == host.outcomes.size())
+                host.bad -= host.outcomes[host.next];
+            else
+                host.count++;
+
+            host.outcomes[host.next] = bad;
+            host.bad += bad;
+            host.next = (host.next + 1) % host.outcomes.size();
+
+            if (host.count == host.outcomes.size() && host.bad * 100 >= host.count * m_Options.threshold)
+            {
+                spdlog::warn("Breaker: {} opened, {} of the last {} requests failed or were slow", name.c_str(),
+                    host.bad, host.count);
+                SetState(host, STATE_OPEN);
+            }
+            break;
+
+        case STATE_HALF_OPEN:
+            if (bad)
+            {
+                spdlog::warn("Breaker: {} is still failing, open again", name.c_str());
+                SetState(host, STATE_OPEN);
+            }
+            else
+            {
+                spdlog::info("Breaker: {} closed", name.c_str());
+                SetState(host, STATE_CLOSED);
+            }
+            break;
+
+        // requests started before it opened
+        case STATE_OPEN:
+            break;
+    }
+}
@@ -0,0 +1,96 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct BreakerOptions
+{
+    unsigned int threshold;             // percent of bad requests that opens it, 0 disables
+    unsigned int requests;              // how many of the last requests are looked at
+    std::chrono::milliseconds slow;     // slower requests count as bad, 0 for no limit
+    std::chrono::seconds open;          // how long it stays open before a request is let through
+
+    BreakerOptions(void) : threshold(0), requests(20), slow(0), open(30) {}
+};
+
+// A circuit breaker for each host web requests are made to. While the
+// share of recent requests to a host that failed, got a 5xx or were too
+// slow stays under the threshold, the breaker is closed. Once it gets
+// there the breaker opens, and requests to that host fail straight away
+// instead of each waiting out a timeout. After a while it is half-open:
+// one request is let through, and closes it again if it succeeds.
+class Breakers
+{
+private:
+    enum State
+    {
+        STATE_CLOSED = 0,
+        STATE_OPEN = 1,
+        STATE_HALF_OPEN = 2,
+    };
+
+    struct Host
+    {
+        State state;
+
+        // the outcome of the last requests, true for bad ones
+        std::vector<bool> outcomes;
+        size_t next;
+        size_t count;
+        size_t bad;
+
+        std::chrono::steady_clock::time_point until;    // when an open breaker lets a probe through
+        bool probing;
+
+        std::atomic<int64_t> *stateGauge;
+        std::atomic<int64_t> *opened;
+        std::atomic<int64_t> *rejected;
+    };
+
+    BreakerOptions m_Options;
+
+    std::mutex m_Mutex;
+    std::map<std::string, Host> m_Hosts;
+
+public:
+    Breakers(const BreakerOptions &options);
+
+    bool Enabled(void) const { return m_Options.threshold > 0; }
+
+    // whether a request to 'host' may go ahead. if it may, its outcome
+    // must be given to Record()
+    bool Allow(const std::string &host);
+
+    void Record(const std::string &host, bool bad, std::chrono::milliseconds latency);
+
+private:
+    Host& Find(const std::string &host);
+    void SetState(Host &host, State state);
+};
@@ -0,0 +1,495 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "codec.hpp"
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CODEC_X86
+#endif
+
+// the vector loops store a full register even when only part of it is
+// valid output, so the output buffer is over-allocated by this much
+#define CODEC_SLACK     32
+
+#define B64_PAD         0x40
+#define B64_SKIP        0x41
+#define B64_BAD         0xFF
+
+static const char s_B64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct CodecTables
+{
+    uint8_t b64[256];
+    int8_t hex[256];
+
+    CodecTables(void)
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            b64[i] = B64_BAD;
+            hex[i] = -1;
+        }
+
+        for (int i = 0; i < 64; ++i)
+            b64[static_cast<uint8_t>(s_B64Alphabet[i])] = i;
+
+        b64['='] = B64_PAD;
+        b64[' '] = b64['\t'] = b64['\r'] = b64['\n'] = B64_SKIP;
+
+        for (int i = 0; i < 10; ++i)
+            hex['0' + i] = i;
+        for (int i = 0; i < 6; ++i)
+            hex['A' + i] = hex['a' + i] = 10 + i;
+    }
+};
+
+static const CodecTables s_Tables;
+
+// consume as many whole blocks as possible, stopping at the first block
+// that needs the scalar code (whitespace, padding or invalid input)
+typedef void (*BlockFn)(const uint8_t *&in, const uint8_t *end, uint8_t *&out);
+
+#ifdef CODEC_X86
+
+// Base64 decoding after W. Mula and D. Lemire, "Faster Base64 Encoding and
+// Decoding using AVX2 Instructions". The nibble lookups both validate and
+// translate the input; maddubs/madd then pack four 6 bit values into 3 bytes.
+
+__attribute__((target("ssse3")))
+static void Base64BlocksSSSE3(const uint8_t *&in, const uint8_t *end, uint8_t *&out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2F = _mm_set1_epi8(0x2F);
+    const __m128i pack = _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    while (end - in >= 16)
+    {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2F);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2F);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+            break;
+
+        const __m128i eq_2F = _mm_cmpeq_epi8(str, mask_2F);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2F, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+
+        str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+        str = _mm_shuffle_epi8(str, pack);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), str);
+        in += 16;
+        out += 12;
+    }
+}
+
+__attribute__((target("avx2")))
+static void Base64BlocksAVX2(const uint8_t *&in, const uint8_t *end, uint8_t *&out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2F = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+    while (end - in >= 32)
+    {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2F);
+        const __m256i lo_nibbles = _mm256_and_si256(str, mask_2F);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+
+        const __m256i eq_2F = _mm256_cmpeq_epi8(str, mask_2F);
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2F, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+        str = _mm256_shuffle_epi8(str, pack);
+        str = _mm256_permutevar8x32_epi32(str, lanes);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), str);
+        in += 32;
+        out += 24;
+    }
+}
+
+// Quoted-printable content is mostly literal. The vector loops copy blocks
+// straight through and stop at the first '=', CR or LF.
+
+__attribute__((target("ssse3")))
+static void QPBlocksSSSE3(const uint8_t *&in, const uint8_t *end, uint8_t *&out)
+{
+    const __m128i eq = _mm_set1_epi8('=');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    while (end - in >= 16)
+    {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(str, eq),
+            _mm_or_si128(_mm_cmpeq_epi8(str, cr), _mm_cmpeq_epi8(str, lf)));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), str);
+
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0)
+        {
+            int literal = __builtin_ctz(mask);
+            in += literal;
+            out += literal;
+            break;
+        }
+
+        in += 16;
+        out += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static void QPBlocksAVX2(const uint8_t *&in, const uint8_t *end, uint8_t *&out)
+{
+    const __m256i eq = _mm256_set1_epi8('=');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    while (end - in >= 32)
+    {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(str, eq),
+            _mm256_or_si256(_mm256_cmpeq_epi8(str, cr), _mm256_cmpeq_epi8(str, lf)));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), str);
+
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(special));
+        if (mask != 0)
+        {
+            int literal = __builtin_ctz(mask);
+            in += literal;
+            out += literal;
+            return;
+        }
+
+        in += 32;
+        out += 32;
+    }
+}
+
+#endif // CODEC_X86
+
+struct CodecDispatch
+{
+    BlockFn base64;
+    BlockFn qp;
+    const char *name;
+
+    CodecDispatch(void) : base64(nullptr), qp(nullptr), name("scalar")
+    {
+#ifdef CODEC_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            base64 = Base64BlocksAVX2;
+            qp = QPBlocksAVX2;
+            name = "avx2";
+        }
+        else if (__builtin_cpu_supports("ssse3"))
+        {
+            base64 = Base64BlocksSSSE3;
+            qp = QPBlocksSSSE3;
+            name = "ssse3";
+        }
+#endif
+    }
+};
+
+static const CodecDispatch s_Dispatch;
+
+struct Base64State
+{
+    uint32_t bits;
+    int count;
+    bool done;      // padding seen
+    bool error;
+};
+
+static inline void Base64Flush(Base64State &state, uint8_t *&out)
+{
+    // a partial quantum is what padding would have completed
+    if (state.count == 2)
+        *out++ = static_cast<uint8_t>(state.bits >> 4);
+    else if (state.count == 3)
+    {
+        *out++ = static_cast<uint8_t>(state.bits >> 10);
+        *out++ = static_cast<uint8_t>(state.bits >> 2);
+    }
+    else if (state.count == 1)
+        state.error = true;
+
+    state.bits = 0;
+    state.count = 0;
+}
+
+static inline void Base64Feed(Base64State &state, uint8_t ch, uint8_t *&out)
+{
+    uint8_t value = s_Tables.b64[ch];
+    if (value < 64)
+    {
+        if (state.done)
+        {
+            state.error = true;     // data after the padding
+            return;
+        }
+
+        state.bits = (state.bits << 6) | value;
+        if (++state.count == 4)
+        {
+            out[0] = static_cast<uint8_t>(state.bits >> 16);
+            out[1] = static_cast<uint8_t>(state.bits >> 8);
+            out[2] = static_cast<uint8_t>(state.bits);
+            out += 3;
+
+            state.bits = 0;
+            state.count = 0;
+        }
+    }
+    else if (value == B64_PAD)
+    {
+        if (!state.done)
+        {
+            Base64Flush(state, out);
+            state.done = true;
+        }
+    }
+    else if (value == B64_BAD)
+        state.error = true;
+}
+
+static bool Base64DecodeWith(BlockFn blocks, const char *in, size_t len, std::string &out)
+{
+    size_t base = out.size();
+    out.resize(base + (len / 4) * 3 + 3 + CODEC_SLACK);
+
+    uint8_t *start = reinterpret_cast<uint8_t*>(&out[base]);
+    uint8_t *o = start;
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *end = p + len;
+
+    Base64State state = { 0, 0, false, false };
+    while (p < end)
+    {
+        // the vector path can only start on a quantum boundary
+        if (blocks && state.count == 0 && !state.done)
+        {
+            blocks(p, end, o);
+            if (p >= end)
+                break;
+        }
+
+        // let the scalar code step over whatever stopped the vector loop
+        do
+        {
+            Base64Feed(state, *p++, o);
+        } while (p < end && state.count != 0);
+    }
+
+    // tolerate missing padding
+    if (!state.done)
+        Base64Flush(state, o);
+
+    out.resize(base + (o - start));
+    return !state.error;
+}
+
+static bool QPDecodeWith(BlockFn blocks, const char *in, size_t len, std::string &out)
+{
+    size_t base = out.size();
+    out.resize(base + len + CODEC_SLACK);
+
+    uint8_t *start = reinterpret_cast<uint8_t*>(&out[base]);
+    uint8_t *o = start;
+    uint8_t *lineStart = o;
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *end = p + len;
+    bool ok = true;
+
+    while (p < end)
+    {
+        if (blocks)
+        {
+            blocks(p, end, o);
+            if (p >= end)
+                break;
+        }
+
+        uint8_t ch = *p;
+        if (ch == '=')
+        {
+            if (end - p >= 3 && s_Tables.hex[p[1]] >= 0 && s_Tables.hex[p[2]] >= 0)
+            {
+                *o++ = static_cast<uint8_t>((s_Tables.hex[p[1]] << 4) | s_Tables.hex[p[2]]);
+                p += 3;
+
+                // an encoded space is content, not trailing whitespace
+                lineStart = o;
+                continue;
+            }
+
+            // soft line break, possibly with transport whitespace before it
+            const uint8_t *q = p + 1;
+            while (q < end && (*q == ' ' || *q == '\t'))
+                ++q;
+            if (q < end && *q == '\r')
+                ++q;
+
+            if (q >= end)
+                p = end;
+            else if (*q == '\n')
+            {
+                p = q + 1;
+                lineStart = o;
+            }
+            else
+            {
+                ok = false;     // stray '=', keep it
+                *o++ = *p++;
+            }
+        }
+        else if (ch == '\r' || ch == '\n')
+        {
+            // trailing whitespace on an encoded line is not content
+            while (o > lineStart && (o[-1] == ' ' || o[-1] == '\t'))
+                --o;
+
+            if (ch == '\r' && end - p >= 2 && p[1] == '\n')
+            {
+                *o++ = '\r';
+                *o++ = '\n';
+                p += 2;
+            }
+            else
+                *o++ = *p++;
+
+            lineStart = o;
+        }
+        else
+            *o++ = *p++;
+    }
+
+    out.resize(base + (o - start));
+    return ok;
+}
+
+bool Base64Decode(const char *in, size_t len, std::string &out)
+{
+    return Base64DecodeWith(s_Dispatch.base64, in, len, out);
+}
+
+bool Base64DecodeScalar(const char *in, size_t len, std::string &out)
+{
+    return Base64DecodeWith(nullptr, in, len, out);
+}
+
+void Base64Encode(const char *in, size_t len, std::string &out)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *end = p + len;
+
+    out.reserve(out.size() + ((len + 2) / 3) * 4);
+    for (; end - p >= 3; p += 3)
+    {
+        uint32_t bits = (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | p[2];
+        out.push_back(s_B64Alphabet[(bits >> 18) & 0x3F]);
+        out.push_back(s_B64Alphabet[(bits >> 12) & 0x3F]);
+        out.push_back(s_B64Alphabet[(bits >> 6) & 0x3F]);
+        out.push_back(s_B64Alphabet[bits & 0x3F]);
+    }
+
+    if (end - p == 1)
+    {
+        uint32_t bits = uint32_t(p[0]) << 16;
+        out.push_back(s_B64Alphabet[(bits >> 18) & 0x3F]);
+        out.push_back(s_B64Alphabet[(bits >> 12) & 0x3F]);
+        out.append("==");
+    }
+    else if (end - p == 2)
+    {
+        uint32_t bits = (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8);
+        out.push_back(s_B64Alphabet[(bits >> 18) & 0x3F]);
+        out.push_back(s_B64Alphabet[(bits >> 12) & 0x3F]);
+        out.push_back(s_B64Alphabet[(bits >> 6) & 0x3F]);
+        out.push_back('=');
+    }
+}
+
+bool QPDecode(const char *in, size_t len, std::string &out)
+{
+    return QPDecodeWith(s_Dispatch.qp, in, len, out);
+}
+
+bool QPDecodeScalar(const char *in, size_t len, std::string &out)
+{
+    return QPDecodeWith(nullptr, in, len, out);
+}
+
+const char* CodecImplementation(void)
+{
+    return s_Dispatch.name;
+}
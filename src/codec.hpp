@@ -0,0 +1,44 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Content-Transfer-Encoding decoders. Output is appended to 'out'. Malformed
+// input is decoded as far as possible and reported by returning false.
+//
+// The default entry points pick an AVX2 or SSSE3 implementation at runtime
+// when the CPU supports it and fall back to the scalar code otherwise.
+
+bool Base64Decode(const char *in, size_t len, std::string &out);
+void Base64Encode(const char *in, size_t len, std::string &out);
+
+bool QPDecode(const char *in, size_t len, std::string &out);
+
+// the portable implementations, always available
+bool Base64DecodeScalar(const char *in, size_t len, std::string &out);
+bool QPDecodeScalar(const char *in, size_t len, std::string &out);
+
+// name of the implementation picked for this CPU: "avx2", "ssse3" or "scalar"
+const char* CodecImplementation(void);
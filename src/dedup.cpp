@@ -0,0 +1,167 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "dedup.hpp"
+#include "metrics.hpp"
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <cstring>
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+static int64_t Now(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// FNV-1a taking a word at a time, then a byte at a time for the tail. Not
+// the standard FNV values, but spread well enough for this and several
+// times faster on a large body
+static uint64_t Hash(uint64_t h, const char *data, size_t len)
+{
+    while (len >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        h = (h ^ word) * FNV_PRIME;
+        h ^= h >> 32;
+
+        data += sizeof(word);
+        len -= sizeof(word);
+    }
+
+    while (len > 0)
+    {
+        h = (h ^ static_cast<unsigned char>(*data)) * FNV_PRIME;
+        data++;
+        len--;
+    }
+
+    // keep fields apart, so "ab" + "c" and "a" + "bc" differ
+    return (h ^ 0xff) * FNV_PRIME;
+}
+
+static void CountLookup(const Route &route, bool hit)
+{
+    std::string labels("{route=\"");
+    labels.append(Metrics::Label(route.name)).append("\"}");
+
+    if (hit)
+        Metrics::Counter("smtp_js_http_dedup_hits_total" + labels, "Repeated messages dropped")++;
+    else
+        Metrics::Counter("smtp_js_http_dedup_misses_total" + labels, "Messages checked for repeats and kept")++;
+}
+
+Dedup::Dedup(size_t maxEntries)
+    : m_MaxEntries(maxEntries > 0 ? maxEntries : 1)
+{
+}
+
+uint64_t Dedup::Key(const Route &route, const email &mail)
+{
+    // by script rather than route name, scripts without a section of their
+    // own share the default route
+    std::string script = ScriptOf(mail.to.empty() ? std::string() : mail.to.front());
+    uint64_t h = Hash(FNV_OFFSET, script.data(), script.length());
+
+    if (route.dedupKey == DEDUP_MESSAGE_ID)
+    {
+        const std::string *id = FindHeader(mail.headers, "Message-ID");
+        if (id && !id->empty())
+            return Hash(h, id->data(), id->length());
+    }
+
+    h = Hash(h, mail.subject.data(), mail.subject.length());
+    return Hash(h, mail.Body(), mail.BodyLength());
+}
+
+// the lock is held
+void Dedup::Expire(int64_t now)
+{
+    // forget what has expired or doesn't fit. an entry that was added
+    // again later is left to its newer place in the order
+    while (!m_Order.empty() && (m_Order.front().second <= now || m_Seen.size() >= m_MaxEntries))
+    {
+        std::unordered_map<uint64_t, int64_t>::iterator i = m_Seen.find(m_Order.front().first);
+        if (i != m_Seen.end() && i->second == m_Order.front().second)
+            m_Seen.erase(i);
+        m_Order.pop_front();
+    }
+}
+
+bool Dedup::IsDuplicate(const Route &route, const email &mail, uint64_t &key)
+{
+    key = 0;
+    if (route.dedupWindow == 0)
+        return false;
+
+    // hashed outside the lock, it's the expensive part. it's done before
+    // the script runs, which may write to the message's buffers
+    key = Key(route, mail);
+    int64_t now = Now();
+    bool hit = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        Expire(now);
+
+        std::unordered_map<uint64_t, int64_t>::iterator i = m_Seen.find(key);
+        hit = ((i != m_Seen.end() && i->second > now) || m_InFlight.count(key) > 0);
+
+        // later repeats, in this batch or another running at the same time,
+        // are dropped while this one is processed
+        if (!hit)
+            m_InFlight.insert(key);
+    }
+
+    CountLookup(route, hit);
+    return hit;
+}
+
+void Dedup::Remember(const Route &route, uint64_t key)
+{
+    if (route.dedupWindow == 0 || key == 0)
+        return;
+
+    int64_t now = Now();
+    int64_t expires = now + static_cast<int64_t>(route.dedupWindow) * 1000;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Expire(now);
+
+    m_InFlight.erase(key);
+    m_Seen[key] = expires;
+    m_Order.push_back(std::make_pair(key, expires));
+}
+
+void Dedup::Forget(uint64_t key)
+{
+    if (key == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_InFlight.erase(key);
+}
@@ -0,0 +1,72 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include "routes.hpp"
+#include "smtp.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+// Drops messages that repeat one seen for the same script within its
+// dedup-window, such as a monitoring loop resending the same alert every
+// few seconds, before they cost a script run. A message counts from when it
+// is handed to the script, and is only remembered if that succeeded.
+// Messages are told apart by a 64 bit hash of their key, kept in a table of
+// at most 'maxEntries' that forgets the oldest first.
+class Dedup
+{
+private:
+    size_t m_MaxEntries;
+
+    std::mutex m_Mutex;
+    std::unordered_map<uint64_t, int64_t> m_Seen;           // hash to expiry
+    std::deque<std::pair<uint64_t, int64_t>> m_Order;       // as added
+    std::unordered_set<uint64_t> m_InFlight;                // being processed
+
+public:
+    Dedup(size_t maxEntries);
+
+    // whether the message repeats one still remembered or being processed.
+    // if it doesn't, it is taken as being processed from now on and 'key'
+    // has to be handed to Remember() or Forget() once it's done. 'key' is 0
+    // if the route doesn't drop repeats
+    bool IsDuplicate(const Route &route, const email &mail, uint64_t &key);
+
+    // the script processed the message, it is remembered for its route's
+    // dedup-window
+    void Remember(const Route &route, uint64_t key);
+
+    // the script failed, so a repeat of the message goes through
+    void Forget(uint64_t key);
+
+private:
+    static uint64_t Key(const Route &route, const email &mail);
+    void Expire(int64_t now);
+};
@@ -0,0 +1,101 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "digest.hpp"
+
+#include <chrono>
+#include <ctime>
+
+// distinct subjects listed, the rest are only counted
+#define DIGEST_SUBJECTS     50
+
+std::string FormatMailDate(int64_t ms)
+{
+    time_t t = static_cast<time_t>(ms / 1000);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+
+    char buf[64];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S +0000", &tm);
+    return std::string(buf);
+}
+
+Digest::Digest(void)
+{
+    m_Info.count = 0;
+    m_Info.oldest = 0;
+    m_Info.newest = 0;
+}
+
+void Digest::Add(const email &mail)
+{
+    if (m_Info.count == 0)
+    {
+        m_First = mail;
+        m_Info.oldest = mail.received;
+        m_Info.newest = mail.received;
+    }
+
+    m_Info.count++;
+    if (mail.received < m_Info.oldest)
+        m_Info.oldest = mail.received;
+    if (mail.received > m_Info.newest)
+        m_Info.newest = mail.received;
+
+    if (m_Subjects.size() < DIGEST_SUBJECTS && m_Subjects.insert(mail.subject).second)
+        m_Info.subjects.push_back(mail.subject);
+}
+
+void Digest::Build(const std::string &subject, const std::string &prefix, email &mail) const
+{
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    mail.from = m_First.from;
+    mail.to.assign(1, m_First.to.front());
+    mail.date = FormatMailDate(now);
+    mail.subject = subject;
+    mail.received = now;
+    mail.digest = std::make_shared<DigestInfo>(m_Info);
+
+    std::string lines[] =
+    {
+        "From: " + mail.from,
+        "To: " + mail.to.front(),
+        "Date: " + mail.date,
+        "Subject: " + mail.subject,
+        prefix + "Count: " + std::to_string(m_Info.count),
+        prefix + "Oldest: " + FormatMailDate(m_Info.oldest),
+        prefix + "Newest: " + FormatMailDate(m_Info.newest),
+    };
+
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); ++l)
+    {
+        AddHeaderLine(mail.headers, lines[l]);
+        mail.data.append(lines[l]).append("\r\n");
+    }
+    mail.data.append("\r\n");
+    mail.bodyOffset = mail.data.length();
+
+    for (std::vector<std::string>::const_iterator i = m_Info.subjects.begin(); i != m_Info.subjects.end(); ++i)
+        mail.data.append((*i)).append("\r\n");
+}
@@ -0,0 +1,64 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "smtp.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+// date header value for a time in milliseconds since the epoch
+std::string FormatMailDate(int64_t ms);
+
+// What an aggregate email stands for, see Digest
+struct DigestInfo
+{
+    size_t count;
+    int64_t oldest;         // received, in milliseconds since the epoch
+    int64_t newest;
+    std::vector<std::string> subjects;
+};
+
+// Collects emails into one aggregate for a script: how many there were,
+// when the first and last of them were received, and their distinct
+// subjects. The aggregate is addressed like the first email added.
+class Digest
+{
+private:
+    email m_First;
+    DigestInfo m_Info;
+    std::set<std::string> m_Subjects;
+
+public:
+    Digest(void);
+
+    void Add(const email &mail);
+    size_t Count(void) const { return m_Info.count; }
+
+    // the aggregate, with 'subject' and <prefix>Count, <prefix>Oldest and
+    // <prefix>Newest headers. its body lists the subjects, one per line
+    void Build(const std::string &subject, const std::string &prefix, email &mail) const;
+};
@@ -0,0 +1,134 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "expiry.hpp"
+#include "metrics.hpp"
+#include "spool.hpp"
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+
+static int64_t Now(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void CountExpired(const Route &route, const char *action)
+{
+    std::string name("smtp_js_http_expired_total{route=\"");
+    name.append(Metrics::Label(route.name)).append("\",action=\"").append(action).append("\"}");
+    Metrics::Counter(name, "Messages that waited longer than their route's max-age")++;
+}
+
+Expiry::Expiry(const std::string &deadLetterPath)
+    : m_DeadLetterPath(deadLetterPath)
+{
+}
+
+bool Expiry::IsExpired(const Route &route, const email &mail) const
+{
+    if (route.maxAge == 0 || mail.received == 0)
+        return false;
+
+    return (Now() - mail.received > static_cast<int64_t>(route.maxAge) * 1000);
+}
+
+bool Expiry::Handle(const Route &route, const email &mail)
+{
+    switch (route.expired)
+    {
+        case EXPIRE_DROP:
+            spdlog::warn("Dropping expired email to {}, subject '{}'", mail.to.front().c_str(),
+                mail.subject.c_str());
+            CountExpired(route, "drop");
+            return true;    // as configured, not a failure
+
+        case EXPIRE_DEAD_LETTER:
+            CountExpired(route, "dead-letter");
+            return DeadLetter(mail);
+
+        case EXPIRE_SUMMARY:
+        {
+            CountExpired(route, "summary");
+
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Summaries[route.name][ScriptOf(mail.to.front())].Add(mail);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Expiry::TakeSummary(const std::string &route, const std::string &script, email &mail)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    std::map<std::string, std::map<std::string, Digest>>::iterator r = m_Summaries.find(route);
+    if (r == m_Summaries.end())
+        return false;
+
+    std::map<std::string, Digest>::iterator i = (script.empty() ? r->second.begin() : r->second.find(script));
+    if (i == r->second.end())
+        return false;
+
+    i->second.Build(std::to_string(i->second.Count()) + " expired message(s)", "X-Expired-", mail);
+    r->second.erase(i);
+    if (r->second.empty())
+        m_Summaries.erase(r);
+    return true;
+}
+
+bool Expiry::DeadLetter(const email &mail)
+{
+    if (m_DeadLetterPath.empty() || !PrepareSpool(m_DeadLetterPath))
+    {
+        spdlog::error("Dropping expired email to {}, no dead-letter directory", mail.to.front().c_str());
+        return false;
+    }
+
+    // the envelope goes in front of the message, so it can be resent
+    std::string envelope("X-Envelope-From: ");
+    envelope.append(mail.from).append("\r\nX-Envelope-To: ");
+    for (std::vector<std::string>::const_iterator i = mail.to.begin(); i != mail.to.end(); ++i)
+    {
+        if (i != mail.to.begin())
+            envelope.append(", ");
+        envelope.append((*i));
+    }
+    envelope.append("\r\nX-Received-At: ").append(FormatMailDate(mail.received)).append("\r\n");
+
+    SpoolWriter writer;
+    if (!writer.Open(m_DeadLetterPath) || !writer.Write(envelope.data(), envelope.length()) ||
+        !writer.Write(mail.Data(), mail.DataLength()) || !writer.Close())
+    {
+        spdlog::error("Dropping expired email to {}, unable to write it to {}", mail.to.front().c_str(),
+            m_DeadLetterPath.c_str());
+        writer.Discard();
+        return false;
+    }
+
+    spdlog::warn("Expired email to {} moved to {}", mail.to.front().c_str(), writer.Path().c_str());
+    writer.Release();
+    return true;
+}
@@ -0,0 +1,60 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "digest.hpp"
+#include "routes.hpp"
+#include "smtp.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+
+// Deals with messages that have waited longer than their route's max-age,
+// so a backlog left by an outage doesn't hold up fresh mail
+class Expiry
+{
+private:
+    std::string m_DeadLetterPath;
+
+    std::mutex m_Mutex;
+    std::map<std::string, std::map<std::string, Digest>> m_Summaries;  // by route, then script
+
+public:
+    Expiry(const std::string &deadLetterPath);
+
+    bool IsExpired(const Route &route, const email &mail) const;
+
+    // drops, dead-letters or summarises an expired message as its route
+    // says. false only if a dead letter couldn't be written, for the
+    // sender's reply
+    bool Handle(const Route &route, const email &mail);
+
+    // the summary of the expired messages collected for a script on 'route'
+    // since the last one, as a message for it. an empty 'script' takes any
+    // on the route. false if there is none
+    bool TakeSummary(const std::string &route, const std::string &script, email &summary);
+
+private:
+    bool DeadLetter(const email &mail);
+};
@@ -0,0 +1,109 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "fiber.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static thread_local Fiber *t_Current = nullptr;
+
+Fiber::Fiber(const std::function<void(void)> &func, size_t stackSize)
+    : m_Stack(nullptr), m_StackSize(0), m_Func(func), m_Done(false)
+{
+    // the stack is only committed as it's used, and running off its end
+    // faults instead of corrupting the heap
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    m_StackSize = (stackSize + page - 1) / page * page + page;
+
+    m_Stack = mmap(nullptr, m_StackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (m_Stack == MAP_FAILED)
+        throw std::runtime_error("Unable to allocate fiber stack");
+    mprotect(m_Stack, page, PROT_NONE);
+
+    getcontext(&m_Context);
+    m_Context.uc_stack.ss_sp = m_Stack;
+    m_Context.uc_stack.ss_size = m_StackSize;
+    m_Context.uc_link = nullptr;
+
+    // makecontext only passes ints
+    uintptr_t self = reinterpret_cast<uintptr_t>(this);
+    makecontext(&m_Context, reinterpret_cast<void (*)(void)>(&Fiber::Entry), 2,
+        static_cast<unsigned int>(static_cast<uint64_t>(self) >> 32), static_cast<unsigned int>(self));
+}
+
+Fiber::~Fiber(void)
+{
+    munmap(m_Stack, m_StackSize);
+}
+
+void Fiber::Entry(unsigned int high, unsigned int low)
+{
+    Fiber *self = reinterpret_cast<Fiber*>(static_cast<uintptr_t>((static_cast<uint64_t>(high) << 32) | low));
+
+    try
+    {
+        self->m_Func();
+    }
+    catch (...)
+    {
+        self->m_Error = std::current_exception();
+    }
+
+    self->m_Done = true;
+    swapcontext(&self->m_Context, &self->m_Caller);
+}
+
+bool Fiber::Resume(void)
+{
+    if (m_Done)
+        return false;
+
+    Fiber *previous = t_Current;
+    t_Current = this;
+    swapcontext(&m_Caller, &m_Context);
+    t_Current = previous;
+
+    if (m_Error)
+    {
+        std::exception_ptr error = m_Error;
+        m_Error = nullptr;
+        std::rethrow_exception(error);
+    }
+
+    return !m_Done;
+}
+
+void Fiber::Yield(void)
+{
+    Fiber *self = t_Current;
+    if (self)
+        swapcontext(&self->m_Context, &self->m_Caller);
+}
+
+Fiber* Fiber::Current(void)
+{
+    return t_Current;
+}
@@ -0,0 +1,66 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <ucontext.h>
+
+// A function run on its own stack, which can give way part way through to
+// whoever resumed it and be picked up again later on the same thread. A
+// worker runs each script in one, so a script waiting for HTTP doesn't
+// hold up the worker.
+class Fiber
+{
+private:
+    ucontext_t m_Context;
+    ucontext_t m_Caller;
+
+    void *m_Stack;              // with a guard page below it
+    size_t m_StackSize;
+
+    std::function<void(void)> m_Func;
+    bool m_Done;
+    std::exception_ptr m_Error;
+
+public:
+    Fiber(const std::function<void(void)> &func, size_t stackSize);
+    ~Fiber(void);
+
+    // runs the function until it returns or yields. returns whether it
+    // still has more to do, and passes on anything it threw
+    bool Resume(void);
+
+    bool IsDone(void) const { return m_Done; }
+
+    // from inside a fiber, gives way to whoever resumed it
+    static void Yield(void);
+
+    // the fiber running on this thread, or nullptr
+    static Fiber* Current(void);
+
+private:
+    static void Entry(unsigned int high, unsigned int low);
+};
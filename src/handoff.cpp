@@ -0,0 +1,259 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "handoff.hpp"
+#include "spdlog/spdlog.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// how long a new process waits for its predecessor to respond
+#define HANDOFF_TIMEOUT     5
+
+// sent by the new process once it is serving
+#define HANDOFF_READY       'R'
+
+static bool MakeAddress(const std::string &path, struct sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path))
+    {
+        spdlog::error("Handoff: socket path {} is too long", path.c_str());
+        return false;
+    }
+
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+Handoff::Handoff(void)
+    : m_Listener(-1), m_Peer(-1), m_Owner(false)
+{
+}
+
+Handoff::~Handoff(void)
+{
+    Close();
+}
+
+int Handoff::Receive(const std::string &path)
+{
+    struct sockaddr_un addr;
+    if (!MakeAddress(path, addr))
+        return -1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+
+    if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1)
+    {
+        // nobody there, this is a normal start
+        close(sock);
+        return -1;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = HANDOFF_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char tag;
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = sizeof(tag);
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+    {
+        spdlog::warn("Handoff: no listener received from {}: {}", path.c_str(), strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+    if (fd == -1)
+    {
+        spdlog::warn("Handoff: predecessor at {} sent no listener", path.c_str());
+        close(sock);
+        return -1;
+    }
+
+    spdlog::info("Handoff: took over the listener from the running process");
+
+    m_Peer = sock;
+    return fd;
+}
+
+bool Handoff::Listen(const std::string &path)
+{
+    struct sockaddr_un addr;
+    if (!MakeAddress(path, addr))
+        return false;
+
+    m_Listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_Listener == -1)
+        return false;
+
+    // a predecessor has already let go of the path, anything there is stale
+    unlink(path.c_str());
+
+    mode_t mask = umask(0077);
+    int result = bind(m_Listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(mask);
+
+    if (result == -1 || listen(m_Listener, 1) == -1)
+    {
+        spdlog::error("Handoff: unable to listen on {}: {}", path.c_str(), strerror(errno));
+        close(m_Listener);
+        m_Listener = -1;
+        return false;
+    }
+
+    m_Path = path;
+    m_Owner = true;
+    return true;
+}
+
+bool Handoff::Send(int fd)
+{
+    int sock = accept4(m_Listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock == -1)
+        return false;
+
+    char tag = 'L';
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = sizeof(tag);
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+    {
+        spdlog::warn("Handoff: unable to pass the listener: {}", strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    m_Peer = sock;
+    return true;
+}
+
+bool Handoff::Confirm(void)
+{
+    char ch = 0;
+    ssize_t n;
+    do
+    {
+        n = recv(m_Peer, &ch, sizeof(ch), 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != 1 || ch != HANDOFF_READY)
+    {
+        ClosePeer();
+        return false;
+    }
+
+    // the path now belongs to the successor, and the connection stays open
+    // until we exit
+    close(m_Listener);
+    m_Listener = -1;
+    m_Owner = false;
+    return true;
+}
+
+bool Handoff::Ready(void)
+{
+    char ch = HANDOFF_READY;
+    if (send(m_Peer, &ch, sizeof(ch), MSG_NOSIGNAL) != 1)
+    {
+        spdlog::warn("Handoff: unable to tell the running process: {}", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void Handoff::ClosePeer(void)
+{
+    if (m_Peer != -1)
+    {
+        close(m_Peer);
+        m_Peer = -1;
+    }
+}
+
+void Handoff::Close(void)
+{
+    ClosePeer();
+
+    if (m_Listener != -1)
+    {
+        close(m_Listener);
+        m_Listener = -1;
+    }
+
+    if (m_Owner)
+    {
+        unlink(m_Path.c_str());
+        m_Owner = false;
+    }
+}
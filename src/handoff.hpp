@@ -0,0 +1,70 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <string>
+
+// Passes the SMTP listening socket from a running process to its
+// replacement over a unix socket (SCM_RIGHTS), so that a restart never
+// leaves the port closed. The running process listens on 'handoff-path';
+// a new process connects to it at startup, receives the socket and, once
+// it is serving, says so over the same connection. Only then does the old
+// one drain and exit; if the new one fails to start instead, the old one
+// carries on. The connection is kept open until the old one exits, so the
+// new process can tell when its predecessor has gone.
+class Handoff
+{
+private:
+    std::string m_Path;
+    int m_Listener;     // successors connect here
+    int m_Peer;         // the predecessor or successor
+    bool m_Owner;       // m_Path is our socket
+
+public:
+    Handoff(void);
+    virtual ~Handoff(void);
+
+    // fetches the listener from a running predecessor at 'path', returns
+    // -1 if there isn't one
+    int Receive(const std::string &path);
+
+    // waits for a successor at 'path'
+    bool Listen(const std::string &path);
+
+    // accepts the waiting successor and passes 'fd' to it. it has to
+    // confirm that it took over before this process lets go
+    bool Send(int fd);
+
+    // after Send, once PeerFd is readable: true if the successor is
+    // serving, false if it went away without doing so
+    bool Confirm(void);
+
+    // tells the predecessor that this process is serving
+    bool Ready(void);
+
+    int ListenerFd(void) const { return m_Listener; }
+    int PeerFd(void) const { return m_Peer; }
+
+    void ClosePeer(void);
+    void Close(void);
+};
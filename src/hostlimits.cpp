@@ -0,0 +1,65 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hostlimits.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#define HOST_SECTION    "host:"
+
+HostLimits::HostLimits(const INIReader &conf, const HostLimit &defaults)
+    : m_Conf(conf), m_Default(defaults)
+{
+}
+
+const HostLimit& HostLimits::Find(const std::string &host)
+{
+    std::map<std::string, HostLimit>::iterator i = m_Hosts.find(host);
+    if (i != m_Hosts.end())
+        return i->second;
+
+    HostLimit &limit = m_Hosts[host];
+    limit = m_Default;
+
+    // a section for the name and port wins over one for the name alone
+    std::string section(HOST_SECTION);
+    section.append(host);
+    if (!m_Conf.HasSection(section))
+    {
+        section.assign(HOST_SECTION);
+        section.append(host, 0, host.rfind(':'));
+    }
+
+    if (m_Conf.HasSection(section))
+    {
+        limit.concurrency = static_cast<unsigned int>(m_Conf.GetInteger(section, "concurrency", limit.concurrency));
+        limit.rate = m_Conf.GetReal(section, "rate", limit.rate);
+        limit.burst = static_cast<unsigned int>(m_Conf.GetInteger(section, "burst", limit.burst));
+    }
+
+    // without a burst, about a second's worth may go at once
+    if (limit.rate > 0 && limit.burst == 0)
+        limit.burst = static_cast<unsigned int>(std::max(1.0, std::ceil(limit.rate)));
+
+    return limit;
+}
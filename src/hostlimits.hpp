@@ -0,0 +1,58 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "INIReader.h"
+
+#include <map>
+#include <string>
+
+// How hard web requests may hit one host
+struct HostLimit
+{
+    unsigned int concurrency;   // requests in flight at once, 0 for no limit
+    double rate;                // requests started per second, 0 for no limit
+    unsigned int burst;         // requests that may start at once after a quiet spell
+
+    HostLimit(void) : concurrency(0), rate(0), burst(0) {}
+
+    bool IsLimited(void) const { return concurrency > 0 || rate > 0; }
+};
+
+// The limits for each host, read from a [host:<name>] section of the
+// configuration, e.g. [host:api.opsgenie.com] or [host:localhost:8080],
+// falling back to the defaults for anything not given. Only used by the
+// engine thread.
+class HostLimits
+{
+private:
+    INIReader m_Conf;
+    HostLimit m_Default;
+    std::map<std::string, HostLimit> m_Hosts;
+
+public:
+    HostLimits(const INIReader &conf, const HostLimit &defaults);
+
+    // the limits for 'host', given as name:port
+    const HostLimit& Find(const std::string &host);
+};
@@ -0,0 +1,292 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "httpengine.hpp"
+#include "metrics.hpp"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <cmath>
+
+// longest the engine thread sleeps when curl has no timeout of its own
+#define ENGINE_POLL_MS      1000
+
+void HttpEngine::Inbox::Post(void *owner, CURLcode result)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Done.push_back(std::make_pair(owner, result));
+    }
+
+    m_Signal.notify_one();
+}
+
+void HttpEngine::Inbox::Wait(std::vector<std::pair<void*, CURLcode>> &done)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (m_Done.empty())
+        m_Signal.wait(lock);
+
+    done.insert(done.end(), m_Done.begin(), m_Done.end());
+    m_Done.clear();
+}
+
+bool HttpEngine::Inbox::Wait(std::vector<std::pair<void*, CURLcode>> &done, std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (!m_Signal.wait_for(lock, timeout, [this] { return !m_Done.empty(); }))
+        return false;
+
+    done.insert(done.end(), m_Done.begin(), m_Done.end());
+    m_Done.clear();
+    return true;
+}
+
+HttpEngine::HttpEngine(HostLimits *limits)
+    : m_Multi(nullptr), m_Limits(limits), m_Stopping(false), m_Waiting(0),
+      m_InFlight(Metrics::Gauge("smtp_js_http_http_in_flight", "Web requests being transferred")),
+      m_Requests(Metrics::Counter("smtp_js_http_http_requests_total", "Web requests made"))
+{
+}
+
+HttpEngine::~HttpEngine(void)
+{
+    Stop();
+
+    if (m_Multi)
+        curl_multi_cleanup(m_Multi);
+}
+
+bool HttpEngine::Start(bool multiplex)
+{
+    m_Multi = curl_multi_init();
+    if (m_Multi == nullptr)
+        return false;
+
+    if (multiplex)
+        curl_multi_setopt(m_Multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    m_Thread = std::thread(&HttpEngine::ThreadProc, this);
+    return true;
+}
+
+void HttpEngine::Stop(void)
+{
+    if (!m_Thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+
+    curl_multi_wakeup(m_Multi);
+    m_Thread.join();
+}
+
+void HttpEngine::Submit(CURL *curl, void *owner, Inbox &inbox, const std::string &host)
+{
+    Transfer transfer;
+    transfer.owner = owner;
+    transfer.inbox = &inbox;
+    transfer.host = host;
+    transfer.submitted = std::chrono::steady_clock::now();
+    transfer.held = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Pending.push_back(std::make_pair(curl, transfer));
+    }
+
+    m_Requests++;
+    m_InFlight++;
+    curl_multi_wakeup(m_Multi);
+}
+
+bool HttpEngine::Add(CURL *curl, const Transfer &transfer)
+{
+    CURLMcode added = curl_multi_add_handle(m_Multi, curl);
+    if (added != CURLM_OK)
+    {
+        spdlog::error("HTTP engine: unable to start request: {}", curl_multi_strerror(added));
+        m_InFlight--;
+        transfer.inbox->Post(transfer.owner, CURLE_FAILED_INIT);
+        return false;
+    }
+
+    m_Running[curl] = transfer;
+    return true;
+}
+
+HttpEngine::HostQueue* HttpEngine::Queue(const std::string &host)
+{
+    if (m_Limits == nullptr || host.empty())
+        return nullptr;
+
+    std::map<std::string, HostQueue>::iterator i = m_Hosts.find(host);
+    if (i != m_Hosts.end())
+        return (i->second.limit ? &i->second : nullptr);
+
+    // hosts without limits are remembered too, so they're only looked up once
+    HostQueue &queue = m_Hosts[host];
+    const HostLimit &limit = m_Limits->Find(host);
+    queue.limit = (limit.IsLimited() ? &limit : nullptr);
+    queue.active = 0;
+    queue.tokens = limit.burst;
+    queue.refilled = std::chrono::steady_clock::now();
+
+    std::string labels = "{host=\"" + Metrics::Label(host) + "\"}";
+    queue.waitingGauge = &Metrics::Gauge("smtp_js_http_http_host_waiting" + labels,
+        "Web requests waiting for their host's concurrency or rate limit");
+    queue.delayed = &Metrics::Counter("smtp_js_http_http_host_delayed_total" + labels,
+        "Web requests held back by their host's concurrency or rate limit");
+    queue.waited = &Metrics::Counter("smtp_js_http_http_host_wait_milliseconds_total" + labels,
+        "Time web requests spent waiting for their host's limits");
+
+    return (queue.limit ? &queue : nullptr);
+}
+
+std::chrono::milliseconds HttpEngine::Release(void)
+{
+    std::chrono::milliseconds next(ENGINE_POLL_MS);
+    if (m_Waiting == 0)
+        return next;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (std::map<std::string, HostQueue>::iterator i = m_Hosts.begin(); i != m_Hosts.end(); ++i)
+    {
+        HostQueue &queue = i->second;
+        if (queue.waiting.empty())
+            continue;
+
+        const HostLimit &limit = *queue.limit;
+        if (limit.rate > 0)
+        {
+            std::chrono::duration<double> elapsed = now - queue.refilled;
+            queue.tokens = std::min<double>(limit.burst, queue.tokens + elapsed.count() * limit.rate);
+            queue.refilled = now;
+        }
+
+        while (!queue.waiting.empty() && (limit.concurrency == 0 || queue.active < limit.concurrency) &&
+            (limit.rate <= 0 || queue.tokens >= 1))
+        {
+            std::pair<CURL*, Transfer> transfer = queue.waiting.front();
+            queue.waiting.pop_front();
+            m_Waiting--;
+            (*queue.waitingGauge)--;
+            (*queue.waited) += std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - transfer.second.submitted).count();
+
+            if (limit.rate > 0)
+                queue.tokens -= 1;
+            if (Add(transfer.first, transfer.second))
+                queue.active++;
+        }
+
+        // the ones that just arrived and couldn't go straight away
+        for (std::deque<std::pair<CURL*, Transfer>>::reverse_iterator r = queue.waiting.rbegin();
+            r != queue.waiting.rend() && !r->second.held; ++r)
+        {
+            r->second.held = true;
+            (*queue.delayed)++;
+        }
+
+        // only a token can come along before a transfer finishes
+        if (!queue.waiting.empty() && limit.rate > 0 && queue.tokens < 1 &&
+            (limit.concurrency == 0 || queue.active < limit.concurrency))
+        {
+            std::chrono::milliseconds wait(static_cast<int64_t>(std::ceil((1 - queue.tokens) * 1000 / limit.rate)));
+            next = std::min(next, std::max(wait, std::chrono::milliseconds(1)));
+        }
+    }
+
+    return next;
+}
+
+void HttpEngine::ThreadProc(void)
+{
+    spdlog::debug("HTTP engine started");
+
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Stopping && m_Pending.empty() && m_Running.empty() && m_Waiting == 0)
+                break;
+
+            for (std::vector<std::pair<CURL*, Transfer>>::iterator i = m_Pending.begin(); i != m_Pending.end(); ++i)
+            {
+                HostQueue *queue = Queue(i->second.host);
+                if (queue == nullptr)
+                {
+                    Add(i->first, i->second);
+                    continue;
+                }
+
+                // goes to the back of its host's queue, which Release() starts in order
+                queue->waiting.push_back((*i));
+                m_Waiting++;
+                (*queue->waitingGauge)++;
+            }
+            m_Pending.clear();
+        }
+
+        std::chrono::milliseconds wait = Release();
+
+        int running = 0;
+        curl_multi_perform(m_Multi, &running);
+
+        CURLMsg *msg;
+        int left = 0;
+        while ((msg = curl_multi_info_read(m_Multi, &left)) != nullptr)
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            CURL *curl = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(m_Multi, curl);
+
+            std::map<CURL*, Transfer>::iterator i = m_Running.find(curl);
+            if (i != m_Running.end())
+            {
+                // frees a slot for the next one waiting
+                HostQueue *queue = Queue(i->second.host);
+                if (queue)
+                {
+                    queue->active--;
+                    wait = std::chrono::milliseconds(0);
+                }
+
+                m_InFlight--;
+                i->second.inbox->Post(i->second.owner, result);
+                m_Running.erase(i);
+            }
+        }
+
+        // woken early by Submit() and Stop()
+        curl_multi_poll(m_Multi, nullptr, 0, static_cast<int>(wait.count()), nullptr);
+    }
+
+    spdlog::debug("HTTP engine stopped");
+}
@@ -0,0 +1,137 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include "hostlimits.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <curl/curl.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Runs the HTTP transfers of every worker on one thread with curl's multi
+// interface. A worker hands over a transfer and is told through its Inbox
+// once it has finished, so it can have any number of them in flight
+// instead of being held up by each round trip.
+//
+// Transfers to a host with a HostLimit wait in a queue of its own until
+// it has a slot and, with a rate, a token to spare. The tokens are topped
+// up at 'rate' a second, to at most 'burst'.
+class HttpEngine
+{
+public:
+    // Finished transfers for one worker, by the owner given to Submit()
+    class Inbox
+    {
+    private:
+        std::mutex m_Mutex;
+        std::condition_variable m_Signal;
+        std::vector<std::pair<void*, CURLcode>> m_Done;
+
+    public:
+        void Post(void *owner, CURLcode result);
+
+        // waits for a transfer to finish, and takes every one that has
+        void Wait(std::vector<std::pair<void*, CURLcode>> &done);
+
+        // as Wait(), giving up after 'timeout'. false if nothing finished
+        bool Wait(std::vector<std::pair<void*, CURLcode>> &done, std::chrono::milliseconds timeout);
+    };
+
+private:
+    struct Transfer
+    {
+        void *owner;
+        Inbox *inbox;
+        std::string host;
+        std::chrono::steady_clock::time_point submitted;
+        bool held;              // had to wait for its host's limits
+    };
+
+    // transfers to a limited host that are waiting their turn
+    struct HostQueue
+    {
+        const HostLimit *limit;
+        std::deque<std::pair<CURL*, Transfer>> waiting;
+        unsigned int active;
+        double tokens;
+        std::chrono::steady_clock::time_point refilled;
+
+        std::atomic<int64_t> *waitingGauge;
+        std::atomic<int64_t> *delayed;
+        std::atomic<int64_t> *waited;
+    };
+
+    CURLM *m_Multi;
+    HostLimits *m_Limits;
+    std::thread m_Thread;
+
+    std::mutex m_Mutex;
+    std::vector<std::pair<CURL*, Transfer>> m_Pending;
+    bool m_Stopping;
+
+    // only touched by the engine thread
+    std::map<CURL*, Transfer> m_Running;
+    std::map<std::string, HostQueue> m_Hosts;
+    size_t m_Waiting;
+
+    std::atomic<int64_t> &m_InFlight;
+    std::atomic<int64_t> &m_Requests;
+
+public:
+    // with 'limits', requests to each host are held to them
+    HttpEngine(HostLimits *limits);
+    ~HttpEngine(void);
+
+    // with 'multiplex', transfers to the same host share an HTTP/2
+    // connection where they can
+    bool Start(bool multiplex);
+
+    // waits for the transfers in flight and stops the engine thread
+    void Stop(void);
+
+    // starts the transfer set up on 'curl', going to 'host' (name:port),
+    // once the host's limits allow. 'inbox' gets 'owner' and the result
+    // once it's done, until then the handle belongs to the engine
+    void Submit(CURL *curl, void *owner, Inbox &inbox, const std::string &host);
+
+private:
+    void ThreadProc(void);
+
+    // false when it couldn't be started, the failure is already posted
+    bool Add(CURL *curl, const Transfer &transfer);
+    HostQueue* Queue(const std::string &host);
+
+    // starts what the hosts' limits allow, and returns how long until a
+    // waiting transfer gets another token
+    std::chrono::milliseconds Release(void);
+};
@@ -0,0 +1,619 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "journal.hpp"
+#include "record.hpp"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <set>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOURNAL_PREFIX      "journal-"
+#define JOURNAL_LOCK        ".lock"
+#define JOURNAL_MAGIC       0x4C4A534Du     // "MSJL"
+#define JOURNAL_RETRY_DELAY std::chrono::seconds(1)     // after a failed write of recovered mail
+
+// every record starts with this header, followed by 'length' bytes of
+// payload. the crc covers the rest of the header and the payload
+struct RecordHeader
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t id;
+    uint32_t length;
+    uint32_t crc;
+};
+
+static_assert(sizeof(RecordHeader) == 24, "journal record header must be packed");
+
+static uint32_t RecordCrc(const RecordHeader &header, const char *payload)
+{
+    return Crc32(payload, header.length, Crc32(&header, offsetof(RecordHeader, crc)));
+}
+
+static void SerializeMail(std::string &buf, const email &mail)
+{
+    PutString(buf, mail.from);
+    PutU64(buf, mail.to.size());
+    for (std::vector<std::string>::const_iterator i = mail.to.begin(); i != mail.to.end(); ++i)
+        PutString(buf, (*i));
+    PutString(buf, mail.date);
+    PutString(buf, mail.subject);
+    PutU64(buf, mail.headers.size());
+    for (MimeHeaders::const_iterator i = mail.headers.begin(); i != mail.headers.end(); ++i)
+    {
+        PutString(buf, i->name);
+        PutString(buf, i->value);
+    }
+    PutU64(buf, mail.bodyOffset);
+    PutString(buf, mail.spoolFile);
+    PutString(buf, mail.data);
+    PutU64(buf, static_cast<uint64_t>(mail.received));
+}
+
+static bool DeserializeMail(const char *data, size_t len, email &mail)
+{
+    PayloadReader reader(data, len);
+
+    reader.GetString(mail.from);
+    uint64_t count = reader.Get<uint64_t>();
+    for (uint64_t i = 0; i < count && reader.Ok(); ++i)
+    {
+        mail.to.push_back(std::string());
+        reader.GetString(mail.to.back());
+    }
+    reader.GetString(mail.date);
+    reader.GetString(mail.subject);
+    count = reader.Get<uint64_t>();
+    for (uint64_t i = 0; i < count && reader.Ok(); ++i)
+    {
+        mail.headers.push_back(MimeHeader());
+        reader.GetString(mail.headers.back().name);
+        reader.GetString(mail.headers.back().value);
+    }
+    mail.bodyOffset = static_cast<size_t>(reader.Get<uint64_t>());
+    reader.GetString(mail.spoolFile);
+    reader.GetString(mail.data);
+
+    // records written before the timestamp was added end here
+    if (reader.Ok() && reader.Remaining() > 0)
+        mail.received = static_cast<int64_t>(reader.Get<uint64_t>());
+
+    return reader.Ok();
+}
+
+static std::string DirName(const std::string &path)
+{
+    std::string::size_type slash = path.rfind('/');
+    return (slash == std::string::npos ? std::string(".") : path.substr(0, slash));
+}
+
+Journal::Journal(Scheduler &queue, ReplyQueue &replies, Backlog &backlog)
+    : m_Queue(queue), m_Replies(replies), m_Backlog(backlog), m_SegmentSize(0), m_Generation(0), m_LockFd(-1),
+    m_Fd(-1), m_Segment(0), m_SegmentLength(0), m_NextId(1), m_Stopping(false),
+    m_OthersRunning(false)
+{
+}
+
+Journal::~Journal(void)
+{
+    Stop();
+}
+
+std::string Journal::SegmentPath(uint32_t generation, uint32_t segment) const
+{
+    char name[40];
+    snprintf(name, sizeof(name), "/" JOURNAL_PREFIX "%08u-%08u", generation, segment);
+
+    return m_Path + name;
+}
+
+std::string Journal::LockPath(uint32_t generation) const
+{
+    char name[40];
+    snprintf(name, sizeof(name), "/" JOURNAL_PREFIX "%08u" JOURNAL_LOCK, generation);
+
+    return m_Path + name;
+}
+
+void Journal::Scan(std::map<uint32_t, std::vector<uint32_t>> &generations) const
+{
+    DIR *d = opendir(m_Path.c_str());
+    if (d == nullptr)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (strncmp(entry->d_name, JOURNAL_PREFIX, strlen(JOURNAL_PREFIX)) != 0)
+            continue;
+
+        char *end;
+        uint32_t generation = static_cast<uint32_t>(strtoul(entry->d_name + strlen(JOURNAL_PREFIX), &end, 10));
+
+        std::vector<uint32_t> &segments = generations[generation];
+        if (*end == '-')
+            segments.push_back(static_cast<uint32_t>(strtoul(end + 1, nullptr, 10)));
+    }
+    closedir(d);
+
+    for (std::map<uint32_t, std::vector<uint32_t>>::iterator i = generations.begin();
+        i != generations.end(); ++i)
+        std::sort(i->second.begin(), i->second.end());
+}
+
+bool Journal::Open(const std::string &dir, size_t segmentSize)
+{
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        spdlog::error("Journal: unable to create {}: {}", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    m_Path = dir;
+    m_SegmentSize = segmentSize;
+
+    std::map<uint32_t, std::vector<uint32_t>> generations;
+    Scan(generations);
+
+    // each process writes its own generation of segments, locked for as
+    // long as it runs, so a predecessor that is still draining can never
+    // be replayed from under it
+    m_Generation = (generations.empty() ? 1 : generations.rbegin()->first + 1);
+
+    std::string lock = LockPath(m_Generation);
+    m_LockFd = open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m_LockFd == -1 || flock(m_LockFd, LOCK_EX | LOCK_NB) == -1)
+    {
+        spdlog::error("Journal: unable to lock {}: {}", lock.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!OpenSegment(1))
+        return false;
+
+    spdlog::info("Journal: opened {}, generation {}", dir.c_str(), m_Generation);
+    return true;
+}
+
+size_t Journal::Recover(std::set<std::string> &spoolFiles)
+{
+    std::map<uint32_t, std::vector<uint32_t>> generations;
+    Scan(generations);
+
+    size_t recovered = 0;
+    m_OthersRunning = false;
+    for (std::map<uint32_t, std::vector<uint32_t>>::iterator i = generations.begin();
+        i != generations.end(); ++i)
+    {
+        if (i->first == m_Generation)
+            continue;
+
+        // if the lock is still held, the process that owns it is alive
+        std::string lock = LockPath(i->first);
+        int fd = open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+            continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+        {
+            spdlog::debug("Journal: generation {} is still in use", i->first);
+            m_OthersRunning = true;
+            close(fd);
+            continue;
+        }
+
+        std::map<uint64_t, email> mails;
+        std::vector<std::string> files;
+        for (std::vector<uint32_t>::iterator segment = i->second.begin(); segment != i->second.end(); ++segment)
+        {
+            files.push_back(SegmentPath(i->first, (*segment)));
+            Replay(files.back(), mails);
+        }
+        files.push_back(lock);
+
+        spdlog::info("Journal: recovering {} message(s) from generation {}", mails.size(), i->first);
+
+        std::unique_lock<std::mutex> guard(m_Mutex);
+
+        // the old files go once their messages are durable in this
+        // generation, or straight away if there aren't any
+        if (mails.empty())
+        {
+            for (std::vector<std::string>::iterator file = files.begin(); file != files.end(); ++file)
+                unlink(file->c_str());
+            close(fd);
+            continue;
+        }
+
+        for (std::map<uint64_t, email>::iterator mail = mails.begin(); mail != mails.end(); ++mail)
+        {
+            if (!mail->second.spoolFile.empty())
+                spoolFiles.insert(mail->second.spoolFile);
+
+            m_Pending.push_back(Entry());
+            Entry &entry = m_Pending.back();
+            entry.type = RECORD_MAIL;
+            entry.id = m_NextId++;
+            entry.token = -1;
+            entry.recovered = true;
+            entry.mail = mail->second;
+            entry.mail.id = entry.id;
+
+            m_Backlog.Add(entry.mail.data.length());
+        }
+
+        m_Obsolete.insert(m_Obsolete.end(), files.begin(), files.end());
+        m_ObsoleteLocks.push_back(fd);
+        recovered += mails.size();
+    }
+
+    if (recovered > 0)
+        m_Signal.notify_one();
+
+    return recovered;
+}
+
+void Journal::Replay(const std::string &path, std::map<uint64_t, email> &mails)
+{
+    std::string content;
+    if (!ReadFile(path, content))
+    {
+        spdlog::error("Journal: unable to open {}: {}", path.c_str(), strerror(errno));
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < content.length())
+    {
+        RecordHeader header;
+        if (content.length() - offset < sizeof(header))
+            break;
+
+        memcpy(&header, content.data() + offset, sizeof(header));
+        const char *payload = content.data() + offset + sizeof(header);
+        if (header.magic != JOURNAL_MAGIC ||
+            content.length() - offset - sizeof(header) < header.length ||
+            RecordCrc(header, payload) != header.crc)
+            break;
+
+        if (header.type == RECORD_MAIL)
+        {
+            email mail;
+            if (DeserializeMail(payload, header.length, mail))
+                mails[header.id] = mail;
+        }
+        else if (header.type == RECORD_DONE)
+            mails.erase(header.id);
+
+        offset += sizeof(header) + header.length;
+    }
+
+    // usually a write that was cut short by a crash, which was never
+    // acknowledged
+    if (offset < content.length())
+        spdlog::warn("Journal: ignoring {} bytes of incomplete records at the end of {}",
+            content.length() - offset, path.c_str());
+}
+
+bool Journal::OpenSegment(uint32_t segment)
+{
+    std::string path = SegmentPath(m_Generation, segment);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        spdlog::error("Journal: unable to create {}: {}", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // make the new directory entry durable as well
+    SyncPath(m_Path, O_RDONLY | O_DIRECTORY);
+
+    if (m_Fd != -1)
+        close(m_Fd);
+
+    m_Fd = fd;
+    m_Segment = segment;
+    m_SegmentLength = 0;
+    m_Outstanding[segment] = 0;
+
+    return true;
+}
+
+void Journal::Retire(void)
+{
+    // done records for a segment can only be in it or a later one, so
+    // segments are only ever removed from the front
+    while (!m_Outstanding.empty() && m_Outstanding.begin()->first != m_Segment &&
+        m_Outstanding.begin()->second == 0)
+    {
+        std::string path = SegmentPath(m_Generation, m_Outstanding.begin()->first);
+        spdlog::debug("Journal: removing completed segment {}", path.c_str());
+
+        unlink(path.c_str());
+        m_Outstanding.erase(m_Outstanding.begin());
+    }
+}
+
+void Journal::Start(void)
+{
+    m_Stopping = false;
+    m_Thread = std::thread(&Journal::ThreadProc, this);
+}
+
+void Journal::Stop(void)
+{
+    if (m_Thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Stopping = true;
+        }
+        m_Signal.notify_one();
+        m_Thread.join();
+    }
+
+    if (m_Fd != -1)
+    {
+        close(m_Fd);
+        m_Fd = -1;
+
+        // nothing left to replay, so the generation can go entirely
+        bool done = true;
+        for (std::map<uint32_t, size_t>::iterator i = m_Outstanding.begin(); i != m_Outstanding.end(); ++i)
+            done = done && (i->second == 0);
+
+        if (done)
+        {
+            for (std::map<uint32_t, size_t>::iterator i = m_Outstanding.begin(); i != m_Outstanding.end(); ++i)
+                unlink(SegmentPath(m_Generation, i->first).c_str());
+            unlink(LockPath(m_Generation).c_str());
+        }
+        m_Outstanding.clear();
+    }
+
+    if (m_LockFd != -1)
+    {
+        close(m_LockFd);
+        m_LockFd = -1;
+    }
+}
+
+void Journal::Append(const email &mail, int token)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        m_Pending.push_back(Entry());
+        Entry &entry = m_Pending.back();
+        entry.type = RECORD_MAIL;
+        entry.id = m_NextId++;
+        entry.token = token;
+        entry.recovered = false;
+        entry.mail = mail;
+        entry.mail.id = entry.id;
+    }
+    m_Signal.notify_one();
+}
+
+void Journal::Complete(uint64_t id)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        m_Pending.push_back(Entry());
+        Entry &entry = m_Pending.back();
+        entry.type = RECORD_DONE;
+        entry.id = id;
+        entry.token = -1;
+        entry.recovered = false;
+    }
+    m_Signal.notify_one();
+}
+
+void Journal::ThreadProc(void)
+{
+    spdlog::debug("Journal thread started");
+
+    std::vector<Entry> batch;
+    std::string buffer;
+    std::vector<std::string> obsolete;
+    std::vector<int> obsoleteLocks;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Signal.wait(lock, [this] { return m_Stopping || !m_Pending.empty(); });
+
+            if (m_Pending.empty())
+                break;  // stopping, and everything is written
+
+            // everything queued while the last batch was being synced goes
+            // out with a single fsync
+            batch.clear();
+            batch.swap(m_Pending);
+
+            obsolete.clear();
+            obsolete.swap(m_Obsolete);
+            obsoleteLocks.clear();
+            obsoleteLocks.swap(m_ObsoleteLocks);
+        }
+
+        buffer.clear();
+        bool sync = false;
+        std::set<std::string> spoolDirs;
+
+        for (std::vector<Entry>::iterator i = batch.begin(); i != batch.end(); ++i)
+        {
+            RecordHeader header;
+            header.magic = JOURNAL_MAGIC;
+            header.type = i->type;
+            header.id = i->id;
+
+            size_t start = buffer.length();
+            buffer.append(sizeof(header), '\0');
+            if (i->type == RECORD_MAIL)
+            {
+                SerializeMail(buffer, i->mail);
+                sync = true;
+
+                // the journal entry is only as good as the file it refers to
+                if (!i->mail.spoolFile.empty())
+                {
+                    if (!SyncPath(i->mail.spoolFile, O_RDONLY))
+                        spdlog::warn("Journal: unable to sync {}", i->mail.spoolFile.c_str());
+                    spoolDirs.insert(DirName(i->mail.spoolFile));
+                }
+            }
+
+            header.length = static_cast<uint32_t>(buffer.length() - start - sizeof(header));
+            header.crc = RecordCrc(header, buffer.data() + start + sizeof(header));
+            memcpy(&buffer[start], &header, sizeof(header));
+        }
+
+        for (std::set<std::string>::iterator i = spoolDirs.begin(); i != spoolDirs.end(); ++i)
+            SyncPath((*i), O_RDONLY | O_DIRECTORY);
+
+        bool ok = true;
+        size_t written = 0;
+        while (written < buffer.length())
+        {
+            ssize_t n = write(m_Fd, buffer.data() + written, buffer.length() - written);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                spdlog::error("Journal: write failed: {}", strerror(errno));
+                ok = false;
+                break;
+            }
+            written += n;
+        }
+
+        // done records don't need to be synced, losing one only means the
+        // message is processed again after a crash
+        if (ok && sync && fdatasync(m_Fd) == -1)
+        {
+            spdlog::error("Journal: sync failed: {}", strerror(errno));
+            ok = false;
+        }
+
+        if (ok)
+            m_SegmentLength += buffer.length();
+        else if (ftruncate(m_Fd, m_SegmentLength) == -1)    // drop any partial record
+            spdlog::error("Journal: unable to truncate: {}", strerror(errno));
+
+        // recovered messages are still in their old generation's files, so
+        // they are kept to be written again rather than dropped
+        std::vector<Entry> retry;
+
+        for (std::vector<Entry>::iterator i = batch.begin(); i != batch.end(); ++i)
+        {
+            if (i->type == RECORD_MAIL)
+            {
+                if (ok)
+                {
+                    m_Location[i->id] = m_Segment;
+                    m_Outstanding[m_Segment]++;
+                    m_Queue.Enqueue(i->mail);
+                }
+                else if (i->recovered)
+                    retry.push_back((*i));
+                else
+                {
+                    // the message is dropped, so nobody else will answer a
+                    // sender waiting for it to be processed or remove its spool
+                    m_Backlog.Remove(i->mail.data.length());
+                    if (i->mail.replyToken >= 0)
+                        m_Replies.Post(i->mail.replyToken, false);
+                    if (!i->mail.spoolFile.empty())
+                        unlink(i->mail.spoolFile.c_str());
+                }
+
+                if (i->token >= 0)
+                    m_Replies.Post(i->token, ok);
+            }
+            else if (ok)
+            {
+                std::map<uint64_t, uint32_t>::iterator loc = m_Location.find(i->id);
+                if (loc != m_Location.end())
+                {
+                    m_Outstanding[loc->second]--;
+                    m_Location.erase(loc);
+                }
+            }
+        }
+
+        // recovered messages are safe in this generation now, if the write
+        // failed the old files are left for the next attempt
+        if (ok && !obsolete.empty())
+        {
+            for (std::vector<std::string>::iterator i = obsolete.begin(); i != obsolete.end(); ++i)
+                unlink(i->c_str());
+            SyncPath(m_Path, O_RDONLY | O_DIRECTORY);
+        }
+
+        if (!retry.empty())
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            if (!m_Stopping)
+            {
+                // the old generation stays ours until they are written
+                spdlog::warn("Journal: writing {} recovered message(s) again shortly", retry.size());
+                m_Pending.insert(m_Pending.begin(), retry.begin(), retry.end());
+                m_Obsolete.insert(m_Obsolete.end(), obsolete.begin(), obsolete.end());
+                m_ObsoleteLocks.insert(m_ObsoleteLocks.end(), obsoleteLocks.begin(), obsoleteLocks.end());
+                obsoleteLocks.clear();
+                retry.clear();
+
+                m_Signal.wait_for(lock, JOURNAL_RETRY_DELAY, [this] { return m_Stopping; });
+            }
+        }
+
+        // stopping, they are left in the old generation for the next start
+        for (std::vector<Entry>::iterator i = retry.begin(); i != retry.end(); ++i)
+            m_Backlog.Remove(i->mail.data.length());
+
+        for (std::vector<int>::iterator i = obsoleteLocks.begin(); i != obsoleteLocks.end(); ++i)
+            close((*i));
+
+        if (m_SegmentLength >= m_SegmentSize)
+            OpenSegment(m_Segment + 1);
+
+        Retire();
+    }
+
+    spdlog::debug("Journal thread stopped");
+}
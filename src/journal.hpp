@@ -0,0 +1,131 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "backlog.hpp"
+#include "scheduler.hpp"
+#include "smtp.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Append-only on-disk log of accepted messages, split into numbered segment
+// files. Messages are written and fsync'd by a single thread in batches, so
+// one fsync covers every session that finished DATA in the meantime. A
+// message is only handed to the worker queue once it is durable, and is
+// marked done once its script has run. Segments are removed once every
+// message in them, and in the segments before them, is done.
+class Journal
+{
+private:
+    enum RecordType
+    {
+        RECORD_MAIL = 1,
+        RECORD_DONE = 2,
+    };
+
+    struct Entry
+    {
+        RecordType type;
+        uint64_t id;
+        int token;
+        email mail;
+        bool recovered;     // from an older generation, whose files still have it
+    };
+
+    Scheduler &m_Queue;
+    ReplyQueue &m_Replies;
+    Backlog &m_Backlog;
+
+    std::string m_Path;
+    size_t m_SegmentSize;
+
+    uint32_t m_Generation;      // segments written by this process
+    int m_LockFd;
+
+    int m_Fd;
+    uint32_t m_Segment;         // index of the segment being written
+    size_t m_SegmentLength;
+    uint64_t m_NextId;
+
+    // messages not yet done, per segment, and the segment of each message
+    std::map<uint32_t, size_t> m_Outstanding;
+    std::map<uint64_t, uint32_t> m_Location;
+
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+    std::condition_variable m_Signal;
+    std::vector<Entry> m_Pending;
+    bool m_Stopping;
+    bool m_OthersRunning;
+
+    // files of recovered generations, removed once their messages are
+    // durable in this one
+    std::vector<std::string> m_Obsolete;
+    std::vector<int> m_ObsoleteLocks;
+
+public:
+    Journal(Scheduler &queue, ReplyQueue &replies, Backlog &backlog);
+    virtual ~Journal(void);
+
+    // starts a new generation of the journal in 'dir'
+    bool Open(const std::string &dir, size_t segmentSize);
+
+    // takes over the messages that weren't marked done from generations no
+    // longer locked by a running process. they are written to this one and
+    // then queued. returns how many there were, and adds the spool files
+    // they refer to to 'spoolFiles'
+    size_t Recover(std::set<std::string> &spoolFiles);
+
+    // whether Recover() left generations alone because another process
+    // still holds them, so their spool files are in use
+    bool OthersRunning(void) const { return m_OthersRunning; }
+
+    void Start(void);
+
+    // writes out anything still pending and stops the journal thread
+    void Stop(void);
+
+    // queue a message to be written. once it is durable it is handed to the
+    // worker queue, and 'token' is posted to the reply queue unless it's -1
+    void Append(const email &mail, int token);
+
+    // the message with this id has been processed
+    void Complete(uint64_t id);
+
+private:
+    void ThreadProc(void);
+
+    bool OpenSegment(uint32_t segment);
+    std::string SegmentPath(uint32_t generation, uint32_t segment) const;
+    std::string LockPath(uint32_t generation) const;
+    void Scan(std::map<uint32_t, std::vector<uint32_t>> &generations) const;
+    void Replay(const std::string &path, std::map<uint64_t, email> &mails);
+    void Retire(void);
+};
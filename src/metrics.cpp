@@ -0,0 +1,143 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "metrics.hpp"
+#include "spdlog/spdlog.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+
+struct MetricFamily
+{
+    const char *type;
+    std::string help;
+
+    // by label set, "" for a value without labels
+    std::map<std::string, std::unique_ptr<std::atomic<int64_t>>> values;
+
+    MetricFamily(void) : type(nullptr) {}
+};
+
+static std::mutex s_Mutex;
+static std::map<std::string, MetricFamily> s_Families;
+
+static std::atomic<int64_t>& FindMetric(const std::string &name, const char *type, const char *help)
+{
+    std::string::size_type brace = name.find('{');
+    std::string family = name.substr(0, brace);
+    std::string labels = (brace == std::string::npos ? std::string() : name.substr(brace));
+
+    std::lock_guard<std::mutex> lock(s_Mutex);
+
+    MetricFamily &f = s_Families[family];
+    if (f.type == nullptr)
+    {
+        f.type = type;
+        f.help.assign(help);
+    }
+
+    std::unique_ptr<std::atomic<int64_t>> &value = f.values[labels];
+    if (!value)
+        value.reset(new std::atomic<int64_t>(0));
+
+    return *value;
+}
+
+std::atomic<int64_t>& Metrics::Counter(const std::string &name, const char *help)
+{
+    return FindMetric(name, "counter", help);
+}
+
+std::atomic<int64_t>& Metrics::Gauge(const std::string &name, const char *help)
+{
+    return FindMetric(name, "gauge", help);
+}
+
+std::string Metrics::Label(const std::string &value)
+{
+    std::string out;
+    out.reserve(value.length());
+
+    for (std::string::const_iterator i = value.begin(); i != value.end(); ++i)
+    {
+        if ((*i) == '\\')
+            out.append("\\\\");
+        else if ((*i) == '"')
+            out.append("\\\"");
+        else if ((*i) == '\n')
+            out.append("\\n");
+        else
+            out.push_back((*i));
+    }
+
+    return out;
+}
+
+bool Metrics::Write(const std::string &path)
+{
+    std::string out;
+    {
+        std::lock_guard<std::mutex> lock(s_Mutex);
+        for (std::map<std::string, MetricFamily>::iterator i = s_Families.begin(); i != s_Families.end(); ++i)
+        {
+            out.append("# HELP ").append(i->first).append(" ").append(i->second.help).append("\n");
+            out.append("# TYPE ").append(i->first).append(" ").append(i->second.type).append("\n");
+
+            for (std::map<std::string, std::unique_ptr<std::atomic<int64_t>>>::iterator v = i->second.values.begin();
+                v != i->second.values.end(); ++v)
+            {
+                out.append(i->first).append(v->first).append(" ");
+                out.append(std::to_string(v->second->load())).append("\n");
+            }
+        }
+    }
+
+    // written next to the real file and renamed over it, so a scrape
+    // never sees half of it
+    std::string tmp(path);
+    tmp.append(".tmp");
+
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == nullptr)
+    {
+        spdlog::warn("Metrics: unable to write {}: {}", tmp.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ok = (fwrite(out.data(), 1, out.length(), f) == out.length());
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) == -1)
+    {
+        spdlog::warn("Metrics: unable to write {}: {}", path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
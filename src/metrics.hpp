@@ -0,0 +1,46 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Counters and gauges shared by every thread. They are written out as a
+// Prometheus text file, e.g. for the node_exporter textfile collector.
+class Metrics
+{
+public:
+    // the value named 'name', which may carry labels, e.g.
+    // smtp_js_http_rejected_total{reason="connection"}. it is created the
+    // first time it's asked for, and the reference stays valid from then on
+    static std::atomic<int64_t>& Counter(const std::string &name, const char *help);
+    static std::atomic<int64_t>& Gauge(const std::string &name, const char *help);
+
+    // 'value' escaped for use between the quotes of a label, for values
+    // that come from outside, e.g. route and host names
+    static std::string Label(const std::string &value);
+
+    // writes every value to 'path', replacing the file in one go
+    static bool Write(const std::string &path);
+};
@@ -0,0 +1,352 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "mime.hpp"
+#include "codec.hpp"
+#include "spdlog/spdlog.h"
+
+#include <cstring>
+#include <strings.h>
+
+static std::string Trim(const std::string &str)
+{
+    std::string::size_type start = str.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos)
+        return std::string();
+
+    std::string::size_type end = str.find_last_not_of(" \t\r\n");
+    return str.substr(start, end - start + 1);
+}
+
+static std::string Lower(const std::string &str)
+{
+    std::string lower(str);
+    for (std::string::iterator i = lower.begin(); i != lower.end(); ++i)
+    {
+        if ((*i) >= 'A' && (*i) <= 'Z')
+            (*i) |= 0x20;
+    }
+
+    return lower;
+}
+
+bool AddHeaderLine(MimeHeaders &headers, const std::string &line)
+{
+    if (line.empty())
+        return false;
+
+    if (line[0] == ' ' || line[0] == '\t')
+    {
+        // folded continuation of the previous header
+        if (headers.empty())
+            return false;
+
+        headers.back().value.append(" ");
+        headers.back().value.append(Trim(line));
+        return true;
+    }
+
+    std::string::size_type colon = line.find(':');
+    if (colon == std::string::npos || colon == 0)
+        return false;
+
+    MimeHeader header;
+    header.name = line.substr(0, colon);
+    header.value = Trim(line.substr(colon + 1));
+    if (header.name.find_first_of(" \t") != std::string::npos)
+        return false;
+
+    headers.push_back(header);
+    return true;
+}
+
+const std::string* FindHeader(const MimeHeaders &headers, const char *name)
+{
+    for (MimeHeaders::const_iterator i = headers.begin(); i != headers.end(); ++i)
+    {
+        if (strcasecmp((*i).name.c_str(), name) == 0)
+            return &(*i).value;
+    }
+
+    return nullptr;
+}
+
+std::string HeaderParam(const std::string &value, const char *param)
+{
+    size_t paramLen = strlen(param);
+    std::string::size_type pos = value.find(';');
+    while (pos != std::string::npos)
+    {
+        ++pos;
+        while (pos < value.length() && (value[pos] == ' ' || value[pos] == '\t'))
+            ++pos;
+
+        std::string::size_type eq = value.find('=', pos);
+        if (eq == std::string::npos)
+            break;
+
+        std::string name = Trim(value.substr(pos, eq - pos));
+        bool match = (name.length() == paramLen &&
+            strncasecmp(name.c_str(), param, paramLen) == 0);
+
+        pos = eq + 1;
+        std::string result;
+        if (pos < value.length() && value[pos] == '"')
+        {
+            // quoted-string, honour backslash escapes
+            for (++pos; pos < value.length() && value[pos] != '"'; ++pos)
+            {
+                if (value[pos] == '\\' && pos + 1 < value.length())
+                    ++pos;
+                result.push_back(value[pos]);
+            }
+
+            pos = value.find(';', pos);
+        }
+        else
+        {
+            std::string::size_type end = value.find(';', pos);
+            result = Trim(value.substr(pos, end == std::string::npos ? std::string::npos : end - pos));
+            pos = end;
+        }
+
+        if (match)
+            return result;
+    }
+
+    return std::string();
+}
+
+MimePart::MimePart(const MimeHeaders &headers, const char *body, size_t len)
+    : m_Headers(headers), m_Body(body), m_BodyLen(len),
+    m_Split(false), m_Decoded(false)
+{
+    ParseContentType();
+}
+
+MimePart::MimePart(const char *data, size_t len)
+    : m_Body(data), m_BodyLen(len), m_Split(false), m_Decoded(false)
+{
+    const char *end = data + len;
+    const char *pos = data;
+    while (pos < end)
+    {
+        const char *eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+        const char *next = (eol ? eol + 1 : end);
+        if (eol == nullptr)
+            eol = end;
+        if (eol > pos && eol[-1] == '\r')
+            --eol;
+
+        if (eol == pos)
+        {
+            pos = next;     // blank line ends the header block
+            break;
+        }
+
+        if (!AddHeaderLine(m_Headers, std::string(pos, eol - pos)))
+            break;          // no header block, the data is all content
+
+        pos = next;
+    }
+
+    m_Body = pos;
+    m_BodyLen = end - pos;
+
+    ParseContentType();
+}
+
+void MimePart::ParseContentType(void)
+{
+    const std::string *value = FindHeader(m_Headers, "Content-Type");
+    if (value)
+    {
+        std::string::size_type semi = value->find(';');
+        m_ContentType = Lower(Trim(value->substr(0, semi)));
+    }
+
+    if (m_ContentType.empty())
+        m_ContentType.assign("text/plain");
+}
+
+std::string MimePart::Charset(void) const
+{
+    const std::string *value = FindHeader(m_Headers, "Content-Type");
+    return (value ? HeaderParam(*value, "charset") : std::string());
+}
+
+std::string MimePart::Filename(void) const
+{
+    const std::string *value = FindHeader(m_Headers, "Content-Disposition");
+    std::string filename;
+    if (value)
+        filename = HeaderParam(*value, "filename");
+
+    if (filename.empty())
+    {
+        value = FindHeader(m_Headers, "Content-Type");
+        if (value)
+            filename = HeaderParam(*value, "name");
+    }
+
+    return filename;
+}
+
+bool MimePart::IsMultipart(void) const
+{
+    return (m_ContentType.compare(0, 10, "multipart/") == 0);
+}
+
+bool MimePart::IsAttachment(void) const
+{
+    const std::string *value = FindHeader(m_Headers, "Content-Disposition");
+    return (value && strncasecmp(value->c_str(), "attachment", 10) == 0);
+}
+
+const std::vector<MimePart>& MimePart::Children(void)
+{
+    if (!m_Split)
+    {
+        m_Split = true;
+        if (IsMultipart())
+            Split();
+    }
+
+    return m_Children;
+}
+
+MimePart::Encoding MimePart::TransferEncoding(void) const
+{
+    const std::string *value = FindHeader(m_Headers, "Content-Transfer-Encoding");
+    if (value)
+    {
+        std::string encoding(Lower(*value));
+        if (encoding.compare("base64") == 0)
+            return ENCODING_BASE64;
+        else if (encoding.compare("quoted-printable") == 0)
+            return ENCODING_QP;
+    }
+
+    return ENCODING_IDENTITY;
+}
+
+std::string& MimePart::Content(void)
+{
+    if (!m_Decoded)
+    {
+        m_Decoded = true;
+
+        bool ok = true;
+        switch (TransferEncoding())
+        {
+            case ENCODING_BASE64:
+                ok = Base64Decode(m_Body, m_BodyLen, m_Content);
+                break;
+
+            case ENCODING_QP:
+                ok = QPDecode(m_Body, m_BodyLen, m_Content);
+                break;
+
+            default:
+                m_Content.assign(m_Body, m_BodyLen);
+                break;
+        }
+
+        if (!ok)
+            spdlog::debug("MIME part {} has malformed transfer encoding", m_ContentType.c_str());
+    }
+
+    return m_Content;
+}
+
+void MimePart::Leaves(std::vector<MimePart*> &leaves)
+{
+    if (!IsMultipart())
+    {
+        leaves.push_back(this);
+        return;
+    }
+
+    Children();
+    for (std::vector<MimePart>::iterator i = m_Children.begin();
+        i != m_Children.end(); ++i)
+        (*i).Leaves(leaves);
+}
+
+// finds the next "--boundary" that starts a line
+static const char* FindDelimiter(const char *start, const char *pos,
+    const char *end, const std::string &delim)
+{
+    while (pos < end)
+    {
+        const char *found = static_cast<const char*>(
+            memmem(pos, end - pos, delim.data(), delim.length()));
+        if (found == nullptr)
+            return nullptr;
+
+        if (found == start || found[-1] == '\n')
+            return found;
+
+        pos = found + 1;
+    }
+
+    return nullptr;
+}
+
+void MimePart::Split(void)
+{
+    const std::string *value = FindHeader(m_Headers, "Content-Type");
+    std::string boundary(value ? HeaderParam(*value, "boundary") : std::string());
+    if (boundary.empty())
+        return;
+
+    std::string delim("--");
+    delim.append(boundary);
+
+    const char *end = m_Body + m_BodyLen;
+
+    // anything before the first delimiter is preamble and is ignored
+    const char *cur = FindDelimiter(m_Body, m_Body, end, delim);
+    while (cur)
+    {
+        const char *after = cur + delim.length();
+        if (end - after >= 2 && after[0] == '-' && after[1] == '-')
+            break;  // close delimiter, the rest is epilogue
+
+        const char *eol = static_cast<const char*>(memchr(after, '\n', end - after));
+        if (eol == nullptr)
+            break;
+
+        const char *partStart = eol + 1;
+        const char *next = FindDelimiter(m_Body, partStart, end, delim);
+        const char *partEnd = (next ? next : end);
+
+        // the line break before a delimiter belongs to the delimiter
+        if (next && partEnd > partStart && partEnd[-1] == '\n')
+            --partEnd;
+        if (next && partEnd > partStart && partEnd[-1] == '\r')
+            --partEnd;
+
+        m_Children.push_back(MimePart(partStart, partEnd - partStart));
+        cur = next;
+    }
+}
@@ -0,0 +1,103 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct MimeHeader
+{
+    std::string name;
+    std::string value;
+};
+
+typedef std::vector<MimeHeader> MimeHeaders;
+
+// Adds one raw header line to 'headers'. Lines starting with whitespace are
+// folded into the previous header. Returns false if the line is not a header.
+bool AddHeaderLine(MimeHeaders &headers, const std::string &line);
+
+// Case-insensitive header lookup, returns nullptr if not present
+const std::string* FindHeader(const MimeHeaders &headers, const char *name);
+
+// Extracts a parameter (e.g. boundary, charset) from a structured header
+// value such as 'multipart/mixed; boundary="abc"'
+std::string HeaderParam(const std::string &value, const char *param);
+
+// A single MIME entity. The part does not own the message text, it only
+// points into the buffer of the email it was created from; the children and
+// the body are only worked out the first time they are asked for.
+class MimePart
+{
+public:
+    enum Encoding
+    {
+        ENCODING_IDENTITY,  // 7bit, 8bit, binary or missing
+        ENCODING_BASE64,
+        ENCODING_QP,
+    };
+
+private:
+    MimeHeaders m_Headers;
+    const char *m_Body;
+    size_t m_BodyLen;
+
+    std::string m_ContentType;
+
+    bool m_Split;
+    std::vector<MimePart> m_Children;
+
+    bool m_Decoded;
+    std::string m_Content;
+
+public:
+    // top level entity, the headers were already parsed during SMTP DATA
+    MimePart(const MimeHeaders &headers, const char *body, size_t len);
+    // nested entity, parses its own headers from 'data'
+    MimePart(const char *data, size_t len);
+
+    const MimeHeaders& Headers(void) const { return m_Headers; }
+
+    // lower-cased "type/subtype", text/plain if the header is missing
+    const std::string& ContentType(void) const { return m_ContentType; }
+    std::string Charset(void) const;
+    std::string Filename(void) const;
+
+    bool IsMultipart(void) const;
+    bool IsAttachment(void) const;
+    Encoding TransferEncoding(void) const;
+
+    const std::vector<MimePart>& Children(void);
+
+    // the content of this part with the transfer encoding removed,
+    // computed once and cached
+    std::string& Content(void);
+
+    // depth-first list of all non-multipart entities
+    void Leaves(std::vector<MimePart*> &leaves);
+
+private:
+    void ParseContentType(void);
+    void Split(void);
+};
@@ -0,0 +1,108 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "record.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// table for the reflected CRC-32 polynomial, built on first use
+struct CrcTable
+{
+    uint32_t entries[256];
+
+    CrcTable(void)
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            entries[i] = c;
+        }
+    }
+};
+
+uint32_t Crc32(const void *data, size_t len, uint32_t crc)
+{
+    // the journal and retry threads may both get here first
+    static const CrcTable table;
+
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    while (len--)
+        crc = table.entries[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+void PutU64(std::string &buf, uint64_t value)
+{
+    buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void PutString(std::string &buf, const std::string &str)
+{
+    uint32_t len = static_cast<uint32_t>(str.length());
+    buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    buf.append(str);
+}
+
+bool ReadFile(const std::string &path, std::string &content)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    content.clear();
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        content.resize(static_cast<size_t>(st.st_size));
+
+        size_t done = 0;
+        while (done < content.length())
+        {
+            ssize_t n = pread(fd, &content[done], content.length() - done, done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        content.resize(done);
+    }
+
+    close(fd);
+    return true;
+}
+
+bool SyncPath(const std::string &path, int flags)
+{
+    int fd = open(path.c_str(), flags | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    int result = fsync(fd);
+    close(fd);
+
+    return (result == 0);
+}
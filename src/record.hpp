@@ -0,0 +1,84 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Helpers for the binary records kept on disk by the journal and the retry
+// spool. Values are written in host byte order, strings with their length
+// in front.
+
+uint32_t Crc32(const void *data, size_t len, uint32_t crc = 0);
+
+void PutU64(std::string &buf, uint64_t value);
+void PutString(std::string &buf, const std::string &str);
+
+// bounds-checked reader for a record payload
+class PayloadReader
+{
+private:
+    const char *m_Ptr;
+    const char *m_End;
+    bool m_Ok;
+
+public:
+    PayloadReader(const char *data, size_t len) : m_Ptr(data), m_End(data + len), m_Ok(true) {}
+
+    bool Ok(void) const { return m_Ok; }
+    size_t Remaining(void) const { return static_cast<size_t>(m_End - m_Ptr); }
+
+    template <typename T>
+    T Get(void)
+    {
+        T value = 0;
+        if (m_Ok && static_cast<size_t>(m_End - m_Ptr) >= sizeof(T))
+        {
+            memcpy(&value, m_Ptr, sizeof(T));
+            m_Ptr += sizeof(T);
+        }
+        else
+            m_Ok = false;
+
+        return value;
+    }
+
+    void GetString(std::string &str)
+    {
+        uint32_t len = Get<uint32_t>();
+        if (m_Ok && static_cast<size_t>(m_End - m_Ptr) >= len)
+        {
+            str.assign(m_Ptr, len);
+            m_Ptr += len;
+        }
+        else
+            m_Ok = false;
+    }
+};
+
+// the whole content of a file. false if it couldn't be opened
+bool ReadFile(const std::string &path, std::string &content);
+
+// fsync a file or, with O_DIRECTORY, a directory
+bool SyncPath(const std::string &path, int flags);
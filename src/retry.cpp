@@ -0,0 +1,587 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "retry.hpp"
+#include "record.hpp"
+#include "webrequest.hpp"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RETRY_PREFIX        "retry-"
+#define RETRY_LOCK          ".lock"
+#define RETRY_TEMP          ".tmp"
+#define RETRY_MAGIC         0x5252534Du     // "MSRR"
+
+// the wheel turns once every RETRY_SLOTS * RETRY_TICK
+#define RETRY_SLOTS         512
+#define RETRY_TICK          std::chrono::milliseconds(100)
+
+// an attempt is given up on after this long, so stopping never waits
+// longer for one
+#define RETRY_TIMEOUT       std::chrono::seconds(30)
+
+// longest Retry-After that is honoured, in seconds
+#define RETRY_AFTER_LIMIT   3600
+
+static int64_t NowMs(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+TimerWheel::TimerWheel(size_t slots, std::chrono::milliseconds tick)
+    : m_Slots(slots), m_Tick(tick), m_Current(0), m_Time(std::chrono::steady_clock::now()), m_Count(0)
+{
+}
+
+void TimerWheel::Add(uint64_t id, std::chrono::steady_clock::time_point due)
+{
+    // anything already due goes in the next slot
+    int64_t ticks = 1;
+    if (due > m_Time)
+        ticks = std::max<int64_t>(1, (due - m_Time + m_Tick - std::chrono::nanoseconds(1)) / m_Tick);
+
+    Timer timer;
+    timer.id = id;
+    timer.turns = static_cast<size_t>((ticks - 1) / static_cast<int64_t>(m_Slots.size()));
+
+    m_Slots[(m_Current + static_cast<size_t>(ticks)) % m_Slots.size()].push_back(timer);
+    m_Count++;
+}
+
+void TimerWheel::Advance(std::chrono::steady_clock::time_point now, std::vector<uint64_t> &due)
+{
+    while (m_Time + m_Tick <= now)
+    {
+        m_Time += m_Tick;
+        m_Current = (m_Current + 1) % m_Slots.size();
+
+        std::vector<Timer> &slot = m_Slots[m_Current];
+        std::vector<Timer>::iterator keep = slot.begin();
+        for (std::vector<Timer>::iterator i = slot.begin(); i != slot.end(); ++i)
+        {
+            if (i->turns == 0)
+            {
+                due.push_back(i->id);
+                m_Count--;
+            }
+            else
+            {
+                i->turns--;
+                *keep++ = *i;
+            }
+        }
+        slot.erase(keep, slot.end());
+    }
+}
+
+RetryQueue::RetryQueue(std::chrono::milliseconds delay, std::chrono::milliseconds maxDelay)
+    : m_Generation(0), m_LockFd(-1), m_NextId(1), m_Delay(delay), m_MaxDelay(maxDelay),
+    m_Random(std::random_device()()), m_Stopping(false), m_Wheel(RETRY_SLOTS, RETRY_TICK),
+    m_Pending(Metrics::Gauge("smtp_js_http_http_retries_pending", "Failed web requests waiting to be retried")),
+    m_Attempts(Metrics::Counter("smtp_js_http_http_retry_attempts_total", "Retries of failed web requests")),
+    m_Delivered(Metrics::Counter("smtp_js_http_http_retries_delivered_total",
+        "Failed web requests that succeeded on a retry")),
+    m_Exhausted(Metrics::Counter("smtp_js_http_http_retries_exhausted_total",
+        "Failed web requests given up on after their last retry"))
+{
+}
+
+RetryQueue::~RetryQueue(void)
+{
+    Stop();
+
+    if (m_LockFd != -1)
+        close(m_LockFd);
+}
+
+std::string RetryQueue::ItemPath(uint32_t generation, uint64_t id) const
+{
+    char name[48];
+    snprintf(name, sizeof(name), "/" RETRY_PREFIX "%08u-%llu", generation, static_cast<unsigned long long>(id));
+
+    return m_Path + name;
+}
+
+std::string RetryQueue::LockPath(uint32_t generation) const
+{
+    char name[40];
+    snprintf(name, sizeof(name), "/" RETRY_PREFIX "%08u" RETRY_LOCK, generation);
+
+    return m_Path + name;
+}
+
+void RetryQueue::Scan(std::map<uint32_t, std::vector<std::string>> &generations) const
+{
+    DIR *d = opendir(m_Path.c_str());
+    if (d == nullptr)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (strncmp(entry->d_name, RETRY_PREFIX, strlen(RETRY_PREFIX)) != 0)
+            continue;
+
+        char *end;
+        uint32_t generation = static_cast<uint32_t>(strtoul(entry->d_name + strlen(RETRY_PREFIX), &end, 10));
+
+        std::vector<std::string> &files = generations[generation];
+        if (*end == '-')
+            files.push_back(m_Path + "/" + entry->d_name);
+    }
+    closedir(d);
+}
+
+bool RetryQueue::Open(const std::string &dir)
+{
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        spdlog::warn("Retry: unable to create {}: {}", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    m_Path = dir;
+
+    std::map<uint32_t, std::vector<std::string>> generations;
+    Scan(generations);
+
+    // as with the journal, each process keeps its own generation of files
+    // so a predecessor that is still draining keeps its retries
+    m_Generation = (generations.empty() ? 1 : generations.rbegin()->first + 1);
+
+    std::string lock = LockPath(m_Generation);
+    m_LockFd = open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m_LockFd == -1 || flock(m_LockFd, LOCK_EX | LOCK_NB) == -1)
+    {
+        spdlog::warn("Retry: unable to lock {}: {}", lock.c_str(), strerror(errno));
+        return false;
+    }
+
+    spdlog::info("Retry: opened {}, generation {}", dir.c_str(), m_Generation);
+    return true;
+}
+
+bool RetryQueue::Load(const std::string &path, RetryItem &item) const
+{
+    std::string content;
+    if (!ReadFile(path, content) || content.length() < 2 * sizeof(uint32_t))
+        return false;
+
+    uint32_t magic, crc;
+    memcpy(&magic, content.data(), sizeof(magic));
+    memcpy(&crc, content.data() + sizeof(magic), sizeof(crc));
+
+    const char *payload = content.data() + 2 * sizeof(uint32_t);
+    size_t length = content.length() - 2 * sizeof(uint32_t);
+    if (magic != RETRY_MAGIC || crc != Crc32(payload, length))
+        return false;
+
+    PayloadReader reader(payload, length);
+    reader.GetString(item.url);
+    item.post = (reader.Get<uint64_t>() != 0);
+    reader.GetString(item.data);
+
+    uint64_t count = reader.Get<uint64_t>();
+    for (uint64_t i = 0; i < count && reader.Ok(); ++i)
+    {
+        item.headers.push_back(std::string());
+        reader.GetString(item.headers.back());
+    }
+
+    item.attempt = static_cast<unsigned int>(reader.Get<uint64_t>());
+    item.attempts = static_cast<unsigned int>(reader.Get<uint64_t>());
+    item.due = static_cast<int64_t>(reader.Get<uint64_t>());
+
+    return reader.Ok();
+}
+
+size_t RetryQueue::Recover(void)
+{
+    std::map<uint32_t, std::vector<std::string>> generations;
+    Scan(generations);
+
+    size_t recovered = 0;
+    for (std::map<uint32_t, std::vector<std::string>>::iterator i = generations.begin();
+        i != generations.end(); ++i)
+    {
+        if (i->first == m_Generation)
+            continue;
+
+        // if the lock is still held, the process that owns it is alive
+        std::string lock = LockPath(i->first);
+        int fd = open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+            continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+        {
+            spdlog::debug("Retry: generation {} is still in use", i->first);
+            close(fd);
+            continue;
+        }
+
+        for (std::vector<std::string>::iterator file = i->second.begin(); file != i->second.end(); ++file)
+        {
+            // a save that never got as far as the rename
+            size_t length = file->length();
+            if (length > strlen(RETRY_TEMP) && file->compare(length - strlen(RETRY_TEMP), std::string::npos,
+                RETRY_TEMP) == 0)
+            {
+                unlink(file->c_str());
+                continue;
+            }
+
+            RetryItem item;
+            if (!Load((*file), item))
+            {
+                spdlog::warn("Retry: dropping unreadable {}", file->c_str());
+                unlink(file->c_str());
+                continue;
+            }
+
+            uint64_t id;
+            {
+                std::unique_lock<std::mutex> guard(m_Mutex);
+                id = m_NextId++;
+            }
+
+            // only removed once it's safely in this generation
+            if (!Save(id, item))
+                continue;
+            unlink(file->c_str());
+
+            std::unique_lock<std::mutex> guard(m_Mutex);
+            m_Added.push_back(std::make_pair(id, item));
+            m_Pending++;
+            recovered++;
+        }
+
+        unlink(lock.c_str());
+        close(fd);
+    }
+
+    return recovered;
+}
+
+void RetryQueue::Start(void)
+{
+    m_Thread = std::thread(&RetryQueue::ThreadProc, this);
+}
+
+void RetryQueue::Stop(void)
+{
+    {
+        std::unique_lock<std::mutex> guard(m_Mutex);
+        m_Stopping = true;
+    }
+
+    if (m_Thread.joinable())
+        m_Thread.join();
+}
+
+bool RetryQueue::IsRetryable(CURLcode result, long status)
+{
+    switch (result)
+    {
+        case CURLE_OK:
+            return (status == 429 || status >= 500);
+
+        // the server couldn't be reached, or the exchange was cut short
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+int64_t RetryQueue::Backoff(unsigned int attempt, long retryAfter)
+{
+    // doubles with each attempt, with the upper half of the range picked
+    // at random so that requests that failed together spread out
+    int64_t delay = m_Delay.count();
+    for (unsigned int i = 1; i < attempt && delay < m_MaxDelay.count(); ++i)
+        delay *= 2;
+    delay = std::min<int64_t>(delay, m_MaxDelay.count());
+
+    {
+        std::unique_lock<std::mutex> guard(m_Mutex);
+        delay = std::uniform_int_distribution<int64_t>(delay / 2, delay)(m_Random);
+    }
+
+    if (retryAfter >= 0)
+        delay = std::max<int64_t>(delay, std::min<long>(retryAfter, RETRY_AFTER_LIMIT) * 1000);
+
+    return delay;
+}
+
+bool RetryQueue::Add(RetryItem item, long retryAfter)
+{
+    if (item.attempt >= item.attempts)
+        return false;
+
+    item.due = NowMs() + Backoff(item.attempt, retryAfter);
+
+    uint64_t id;
+    {
+        std::unique_lock<std::mutex> guard(m_Mutex);
+        id = m_NextId++;
+    }
+
+    if (!Save(id, item))
+        return false;
+
+    spdlog::info("Retry: {} failed, attempt {} of {} in {} ms", item.url.c_str(), item.attempt + 1,
+        item.attempts, item.due - NowMs());
+
+    std::unique_lock<std::mutex> guard(m_Mutex);
+    m_Added.push_back(std::make_pair(id, item));
+    m_Pending++;
+    return true;
+}
+
+bool RetryQueue::Save(uint64_t id, const RetryItem &item)
+{
+    std::string payload;
+    PutString(payload, item.url);
+    PutU64(payload, item.post ? 1 : 0);
+    PutString(payload, item.data);
+    PutU64(payload, item.headers.size());
+    for (std::vector<std::string>::const_iterator i = item.headers.begin(); i != item.headers.end(); ++i)
+        PutString(payload, (*i));
+    PutU64(payload, item.attempt);
+    PutU64(payload, item.attempts);
+    PutU64(payload, static_cast<uint64_t>(item.due));
+
+    uint32_t header[2] = { RETRY_MAGIC, Crc32(payload.data(), payload.length()) };
+    std::string content(reinterpret_cast<const char*>(header), sizeof(header));
+    content.append(payload);
+
+    // written aside and renamed over the last copy, so a crash leaves
+    // one or the other
+    std::string path = ItemPath(m_Generation, id);
+    std::string temp = path + RETRY_TEMP;
+
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        spdlog::error("Retry: unable to create {}: {}", temp.c_str(), strerror(errno));
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < content.length())
+    {
+        ssize_t n = write(fd, content.data() + done, content.length() - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    bool ok = (done == content.length() && fsync(fd) == 0);
+    close(fd);
+
+    if (!ok || rename(temp.c_str(), path.c_str()) == -1)
+    {
+        spdlog::error("Retry: unable to write {}: {}", path.c_str(), strerror(errno));
+        unlink(temp.c_str());
+        return false;
+    }
+
+    SyncPath(m_Path, O_RDONLY | O_DIRECTORY);
+    return true;
+}
+
+void RetryQueue::Remove(uint64_t id)
+{
+    unlink(ItemPath(m_Generation, id).c_str());
+}
+
+void RetryQueue::Schedule(uint64_t id, const RetryItem &item)
+{
+    // the due time is kept as wall clock time so that it means the same
+    // after a restart
+    std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(std::max<int64_t>(0, item.due - NowMs()));
+
+    m_Wheel.Add(id, due);
+}
+
+void RetryQueue::Send(uint64_t id)
+{
+    std::map<uint64_t, RetryItem>::iterator i = m_Waiting.find(id);
+    if (i == m_Waiting.end())
+        return;
+
+    const RetryItem &item = i->second;
+
+    WebRequest *request = new WebRequest;
+    request->SetRetries(0);
+    request->SetKeepResult(false);
+    request->SetTimeout(RETRY_TIMEOUT);
+    for (std::vector<std::string>::const_iterator header = item.headers.begin(); header != item.headers.end();
+        ++header)
+    {
+        std::string::size_type colon = header->find(':');
+        if (colon == std::string::npos)
+            continue;
+
+        std::string::size_type value = header->find_first_not_of(' ', colon + 1);
+        request->Header(header->substr(0, colon), value == std::string::npos ? "" : header->substr(value));
+    }
+
+    if (item.post)
+        request->PostData(item.data);
+
+    // tried again a little later if it can't be started at all
+    if (!request->Start(item.url, item.post))
+    {
+        delete request;
+        m_Wheel.Add(id, std::chrono::steady_clock::now() + m_Delay);
+        return;
+    }
+
+    m_Attempts++;
+    m_Running[request] = id;
+}
+
+void RetryQueue::Finished(WebRequest *request)
+{
+    std::map<WebRequest*, uint64_t>::iterator running = m_Running.find(request);
+    uint64_t id = running->second;
+    m_Running.erase(running);
+
+    std::map<uint64_t, RetryItem>::iterator i = m_Waiting.find(id);
+    RetryItem &item = i->second;
+
+    // the host's breaker is open, which doesn't use up an attempt
+    if (request->Rejected())
+    {
+        m_Wheel.Add(id, std::chrono::steady_clock::now() + m_Delay);
+        delete request;
+        return;
+    }
+
+    item.attempt++;
+
+    CURLcode result = request->Code();
+    long status = request->Status();
+
+    if (result == CURLE_OK && status < 400)
+    {
+        spdlog::info("Retry: {} succeeded on attempt {}", item.url.c_str(), item.attempt);
+        m_Delivered++;
+    }
+    else if (IsRetryable(result, status) && item.attempt < item.attempts)
+    {
+        item.due = NowMs() + Backoff(item.attempt, request->RetryAfter());
+
+        // if it can't be saved it's still retried from memory. the previous
+        // copy stays on disk, so a restart at worst repeats an attempt
+        if (!Save(id, item))
+            spdlog::warn("Retry: {} is only up to date in memory", item.url.c_str());
+
+        spdlog::info("Retry: {} failed again ({}), attempt {} of {} in {} ms", item.url.c_str(),
+            result == CURLE_OK ? std::to_string(status) : request->Error(), item.attempt + 1,
+            item.attempts, item.due - NowMs());
+
+        Schedule(id, item);
+        delete request;
+        return;
+    }
+    else
+    {
+        spdlog::error("Retry: giving up on {} after {} attempt(s): {}", item.url.c_str(), item.attempt,
+            result == CURLE_OK ? "HTTP status " + std::to_string(status) : request->Error());
+        m_Exhausted++;
+    }
+
+    Remove(id);
+    m_Waiting.erase(i);
+    m_Pending--;
+    delete request;
+}
+
+void RetryQueue::ThreadProc(void)
+{
+    spdlog::debug("Retry thread started");
+
+    while (true)
+    {
+        std::vector<std::pair<uint64_t, RetryItem>> added;
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> guard(m_Mutex);
+            added.swap(m_Added);
+            stopping = m_Stopping;
+        }
+
+        for (std::vector<std::pair<uint64_t, RetryItem>>::iterator i = added.begin(); i != added.end(); ++i)
+        {
+            m_Waiting[i->first] = i->second;
+            Schedule(i->first, i->second);
+        }
+
+        // what hasn't started yet stays on disk for the next start
+        if (stopping && m_Running.empty())
+            break;
+
+        if (!stopping)
+        {
+            std::vector<uint64_t> due;
+            m_Wheel.Advance(std::chrono::steady_clock::now(), due);
+            for (std::vector<uint64_t>::iterator i = due.begin(); i != due.end(); ++i)
+                Send((*i));
+        }
+
+        // the wait for attempts to finish is the tick of the wheel
+        std::vector<RequestContext*> ready;
+        WebRequest::Collect(RETRY_TICK, ready);
+
+        WebRequest *request;
+        while (WebRequest::TakeFinished(request))
+            Finished(request);
+    }
+
+    spdlog::debug("Retry thread stopped");
+}
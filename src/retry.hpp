@@ -0,0 +1,166 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "metrics.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <curl/curl.h>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class WebRequest;
+
+// A request that failed and is to be sent again
+struct RetryItem
+{
+    std::string url;
+    bool post;
+    std::string data;
+    std::vector<std::string> headers;   // as "Name: value"
+
+    unsigned int attempt;       // attempts made so far
+    unsigned int attempts;      // most to make, counting the first
+    int64_t due;                // next attempt, in milliseconds since the epoch
+
+    RetryItem(void) : post(false), attempt(0), attempts(0), due(0) {}
+};
+
+// Hashed timing wheel of 'slots' buckets, each 'tick' long. A timer more
+// than one turn away stays in its bucket for the turns it has still to go,
+// so adding one and advancing the clock cost the same however many are set.
+class TimerWheel
+{
+private:
+    struct Timer
+    {
+        uint64_t id;
+        size_t turns;
+    };
+
+    std::vector<std::vector<Timer>> m_Slots;
+    std::chrono::milliseconds m_Tick;
+    size_t m_Current;
+    std::chrono::steady_clock::time_point m_Time;   // when the current slot came due
+    size_t m_Count;
+
+public:
+    TimerWheel(size_t slots, std::chrono::milliseconds tick);
+
+    // 'id' is returned by Advance() once 'due' has passed, to within a tick
+    void Add(uint64_t id, std::chrono::steady_clock::time_point due);
+
+    // moves the wheel on to 'now', adding the timers that came due to 'due'
+    void Advance(std::chrono::steady_clock::time_point now, std::vector<uint64_t> &due);
+
+    size_t Size(void) const { return m_Count; }
+};
+
+// Web requests that failed with a connection error, 429 or a 5xx, sent
+// again later with exponential backoff and jitter, or after the time the
+// server asked for with Retry-After. Each is saved in its own file in the
+// retry directory before it's taken over, so the messages whose scripts
+// made them can be marked done, and the ones still waiting when the
+// process stops are picked up by the next start.
+//
+// The waiting is done on a thread of its own, so workers never sit out a
+// backoff.
+class RetryQueue
+{
+private:
+    std::string m_Path;
+    uint32_t m_Generation;      // files written by this process
+    int m_LockFd;
+    uint64_t m_NextId;
+
+    std::chrono::milliseconds m_Delay;
+    std::chrono::milliseconds m_MaxDelay;
+
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+    std::vector<std::pair<uint64_t, RetryItem>> m_Added;
+    std::mt19937 m_Random;
+    bool m_Stopping;
+
+    // only touched by the retry thread
+    std::map<uint64_t, RetryItem> m_Waiting;
+    std::map<WebRequest*, uint64_t> m_Running;
+    TimerWheel m_Wheel;
+
+    std::atomic<int64_t> &m_Pending;
+    std::atomic<int64_t> &m_Attempts;
+    std::atomic<int64_t> &m_Delivered;
+    std::atomic<int64_t> &m_Exhausted;
+
+public:
+    // the first retry waits about 'delay', each one after that twice as
+    // long as the last, up to 'maxDelay'
+    RetryQueue(std::chrono::milliseconds delay, std::chrono::milliseconds maxDelay);
+    virtual ~RetryQueue(void);
+
+    // starts a new generation of the retry spool in 'dir'
+    bool Open(const std::string &dir);
+
+    // takes over the requests left by generations no longer locked by a
+    // running process. returns how many there were
+    size_t Recover(void);
+
+    // needs the engine WebRequest::Init() starts
+    void Start(void);
+
+    // stops the retry thread once the attempts in flight are over. the
+    // requests still waiting stay on disk for the next start
+    void Stop(void);
+
+    // takes over 'item' after its 'attempt'th attempt failed, and saves
+    // it. 'retryAfter' is the delay the server asked for in seconds, or -1.
+    // false if it has had all its attempts or couldn't be saved, in which
+    // case it is still the caller's failure
+    bool Add(RetryItem item, long retryAfter);
+
+    // whether a request that ended this way is worth another go
+    static bool IsRetryable(CURLcode result, long status);
+
+private:
+    void ThreadProc(void);
+
+    void Send(uint64_t id);
+    void Finished(WebRequest *request);
+
+    int64_t Backoff(unsigned int attempt, long retryAfter);
+    bool Save(uint64_t id, const RetryItem &item);
+    void Remove(uint64_t id);
+    void Schedule(uint64_t id, const RetryItem &item);
+
+    std::string ItemPath(uint32_t generation, uint64_t id) const;
+    std::string LockPath(uint32_t generation) const;
+    void Scan(std::map<uint32_t, std::vector<std::string>> &generations) const;
+    bool Load(const std::string &path, RetryItem &item) const;
+};
@@ -0,0 +1,228 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "routes.hpp"
+#include "spdlog/spdlog.h"
+
+#include <sstream>
+#include <strings.h>
+
+#define ROUTE_SECTION       "route:"
+#define PRIORITY_SECTION    "priority:"
+
+#define DEFAULT_PRIORITIES  "high, normal, low"
+#define DEFAULT_PRIORITY    "normal"
+
+bool ParseAckMode(const std::string &str, AckMode &mode)
+{
+    if (str.compare("queued") == 0)
+        mode = ACK_QUEUED;
+    else if (str.compare("durable") == 0)
+        mode = ACK_DURABLE;
+    else if (str.compare("processed") == 0)
+        mode = ACK_PROCESSED;
+    else
+        return false;
+
+    return true;
+}
+
+bool ParseExpireAction(const std::string &str, ExpireAction &action)
+{
+    if (str.compare("drop") == 0)
+        action = EXPIRE_DROP;
+    else if (str.compare("dead-letter") == 0)
+        action = EXPIRE_DEAD_LETTER;
+    else if (str.compare("summary") == 0)
+        action = EXPIRE_SUMMARY;
+    else
+        return false;
+
+    return true;
+}
+
+bool ParseDedupKey(const std::string &str, DedupKey &key)
+{
+    if (str.compare("content") == 0)
+        key = DEDUP_CONTENT;
+    else if (str.compare("message-id") == 0)
+        key = DEDUP_MESSAGE_ID;
+    else
+        return false;
+
+    return true;
+}
+
+static std::string Trim(const std::string &str)
+{
+    std::string::size_type start = str.find_first_not_of(" \t");
+    if (start == std::string::npos)
+        return std::string();
+
+    return str.substr(start, str.find_last_not_of(" \t") - start + 1);
+}
+
+std::string ScriptOf(const std::string &to)
+{
+    std::string::size_type at = to.find('@');
+    return (at == std::string::npos ? std::string() : to.substr(at + 1));
+}
+
+RouteTable::RouteTable(const INIReader &conf, const Route &defaults)
+    : m_Conf(conf), m_Default(defaults)
+{
+    m_Default.name = DEFAULT_ROUTE;
+
+    std::istringstream classes(m_Conf.Get("smtp-js-http", "priorities", DEFAULT_PRIORITIES));
+    std::string name;
+    while (std::getline(classes, name, ','))
+    {
+        name = Trim(name);
+        if (!name.empty())
+            m_Classes.push_back(name);
+    }
+
+    if (m_Classes.empty())
+        m_Classes.push_back(DEFAULT_PRIORITY);
+
+    // without a priority of their own, messages go in "normal" if there is
+    // such a class, otherwise the lowest
+    std::string priority = m_Conf.Get("smtp-js-http", "priority", "");
+    if (priority.empty() || !ParsePriority(priority, m_Default.priority))
+    {
+        if (!priority.empty())
+            spdlog::warn("Unknown priority '{}'", priority.c_str());
+
+        if (!ParsePriority(DEFAULT_PRIORITY, m_Default.priority))
+            m_Default.priority = static_cast<unsigned int>(m_Classes.size() - 1);
+    }
+
+    for (unsigned int i = 0; i < m_Classes.size(); ++i)
+    {
+        std::string section(PRIORITY_SECTION);
+        section.append(m_Classes[i]);
+
+        std::string header = m_Conf.Get(section, "header", "");
+        if (header.empty())
+            continue;
+
+        std::string::size_type colon = header.find(':');
+        if (colon == std::string::npos)
+        {
+            spdlog::warn("Priority {}: header should look like 'Name: value'", m_Classes[i].c_str());
+            continue;
+        }
+
+        PriorityRule rule;
+        rule.header = Trim(header.substr(0, colon));
+        rule.value = Trim(header.substr(colon + 1));
+        rule.priority = i;
+        m_Rules.push_back(rule);
+    }
+}
+
+bool RouteTable::ParsePriority(const std::string &name, unsigned int &priority) const
+{
+    for (unsigned int i = 0; i < m_Classes.size(); ++i)
+    {
+        if (strcasecmp(m_Classes[i].c_str(), name.c_str()) == 0)
+        {
+            priority = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+unsigned int RouteTable::Priority(const Route &route, const MimeHeaders &headers) const
+{
+    unsigned int priority = route.priority;
+    for (std::vector<PriorityRule>::const_iterator i = m_Rules.begin(); i != m_Rules.end(); ++i)
+    {
+        if (i->priority >= priority)
+            continue;
+
+        const std::string *value = FindHeader(headers, i->header.c_str());
+        if (value && strncasecmp(Trim(*value).c_str(), i->value.c_str(), i->value.length()) == 0)
+            priority = i->priority;
+    }
+
+    return priority;
+}
+
+const Route& RouteTable::Find(const std::string &name) const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    std::map<std::string, Route>::iterator i = m_Routes.find(name);
+    if (i != m_Routes.end())
+        return i->second;
+
+    std::string section(ROUTE_SECTION);
+    section.append(name);
+    if (!m_Conf.HasSection(section))
+        return m_Default;
+
+    Route &route = m_Routes[name];
+    route = m_Default;
+    route.name = name;
+
+    std::string ack = m_Conf.Get(section, "ack-mode", "");
+    if (!ack.empty() && !ParseAckMode(ack, route.ackMode))
+        spdlog::warn("Route {}: unknown ack-mode '{}'", name.c_str(), ack.c_str());
+
+    route.weight = static_cast<unsigned int>(m_Conf.GetInteger(section, "weight", route.weight));
+    route.concurrency = static_cast<unsigned int>(m_Conf.GetInteger(section, "concurrency",
+        route.concurrency));
+
+    std::string priority = m_Conf.Get(section, "priority", "");
+    if (!priority.empty() && !ParsePriority(priority, route.priority))
+        spdlog::warn("Route {}: unknown priority '{}'", name.c_str(), priority.c_str());
+
+    route.maxAge = static_cast<unsigned int>(m_Conf.GetInteger(section, "max-age", route.maxAge));
+
+    route.batchSize = static_cast<unsigned int>(m_Conf.GetInteger(section, "batch-size", route.batchSize));
+    route.digestWindow = static_cast<unsigned int>(m_Conf.GetInteger(section, "digest-window",
+        route.digestWindow));
+    route.digestCount = static_cast<unsigned int>(m_Conf.GetInteger(section, "digest-count",
+        route.digestCount));
+
+    std::string expired = m_Conf.Get(section, "expired", "");
+    if (!expired.empty() && !ParseExpireAction(expired, route.expired))
+        spdlog::warn("Route {}: unknown expired action '{}'", name.c_str(), expired.c_str());
+
+    route.dedupWindow = static_cast<unsigned int>(m_Conf.GetInteger(section, "dedup-window",
+        route.dedupWindow));
+    std::string dedupKey = m_Conf.Get(section, "dedup-key", "");
+    if (!dedupKey.empty() && !ParseDedupKey(dedupKey, route.dedupKey))
+        spdlog::warn("Route {}: unknown dedup-key '{}'", name.c_str(), dedupKey.c_str());
+
+    route.retries = static_cast<unsigned int>(m_Conf.GetInteger(section, "http-retries", route.retries));
+
+    return route;
+}
+
+const Route& RouteTable::ForRecipient(const std::string &to) const
+{
+    return Find(ScriptOf(to));
+}
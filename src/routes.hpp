@@ -0,0 +1,145 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "INIReader.h"
+#include "mime.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// When the reply to DATA is sent
+enum AckMode
+{
+    ACK_QUEUED,         // as soon as the message is received
+    ACK_DURABLE,        // once the message is in the journal
+    ACK_PROCESSED,      // once the script has run, 451 if it failed
+};
+
+bool ParseAckMode(const std::string &str, AckMode &mode);
+
+// What happens to a message that has waited longer than its route's max-age
+enum ExpireAction
+{
+    EXPIRE_DROP,            // discarded
+    EXPIRE_DEAD_LETTER,     // written to the dead-letter directory
+    EXPIRE_SUMMARY,         // counted into one summary message for the script
+};
+
+bool ParseExpireAction(const std::string &str, ExpireAction &action);
+
+// What makes two messages the same, for dropping repeats
+enum DedupKey
+{
+    DEDUP_CONTENT,          // route, subject and body
+    DEDUP_MESSAGE_ID,       // route and Message-ID, or the content without one
+};
+
+bool ParseDedupKey(const std::string &str, DedupKey &key);
+
+// the script file a recipient such as main@opsgenie.js is handled by
+std::string ScriptOf(const std::string &to);
+
+// the route of every script without a [route:<script>] section of its own
+#define DEFAULT_ROUTE   "*"
+
+// Settings for the messages handled by one script file. They are read from
+// a [route:<script>] section of the configuration, e.g. [route:opsgenie.js],
+// falling back to the defaults for anything not given.
+struct Route
+{
+    std::string name;
+    AckMode ackMode;
+    unsigned int weight;        // share of the workers when routes compete
+    unsigned int concurrency;   // most workers at once, 0 for no limit
+    unsigned int priority;      // index of the priority class, 0 is the highest
+    unsigned int maxAge;        // seconds a message may wait, 0 for no limit
+    ExpireAction expired;
+    unsigned int batchSize;     // most messages handed to the script at once
+
+    // messages are collected into one digest for this many seconds, or
+    // until there are this many of them. both 0 to disable
+    unsigned int digestWindow;
+    unsigned int digestCount;
+
+    // seconds a repeat of a message is dropped for, 0 to disable
+    unsigned int dedupWindow;
+    DedupKey dedupKey;
+
+    // further attempts at a web request that failed in a way that may
+    // pass, 0 to leave the failure to the script
+    unsigned int retries;
+
+    Route(void) : ackMode(ACK_DURABLE), weight(1), concurrency(0), priority(0), maxAge(0),
+        expired(EXPIRE_DEAD_LETTER), batchSize(1), digestWindow(0), digestCount(0),
+        dedupWindow(0), dedupKey(DEDUP_CONTENT), retries(0) {}
+
+    bool IsDigest(void) const { return digestWindow > 0 || digestCount > 0; }
+};
+
+// Puts messages carrying a header into a priority class, e.g.
+// "X-Priority: 1". The value matches if the header starts with it.
+struct PriorityRule
+{
+    std::string header;
+    std::string value;
+    unsigned int priority;
+};
+
+class RouteTable
+{
+private:
+    INIReader m_Conf;
+    Route m_Default;
+
+    // priority classes, highest first, and the headers that select them
+    std::vector<std::string> m_Classes;
+    std::vector<PriorityRule> m_Rules;
+
+    // routes are looked up from several threads, and each is only read
+    // from the configuration once. only configured routes are kept, so
+    // recipients made up by a sender can't add queues and metrics without
+    // limit
+    mutable std::mutex m_Mutex;
+    mutable std::map<std::string, Route> m_Routes;
+
+public:
+    RouteTable(const INIReader &conf, const Route &defaults);
+
+    // the route of a script, the default one if it has no section
+    const Route& Find(const std::string &name) const;
+
+    // the route for a recipient such as main@opsgenie.js
+    const Route& ForRecipient(const std::string &to) const;
+
+    const std::vector<std::string>& Classes(void) const { return m_Classes; }
+
+    // the priority class of a message on 'route': the route's own, or a
+    // higher one if one of the headers asks for it
+    unsigned int Priority(const Route &route, const MimeHeaders &headers) const;
+
+private:
+    bool ParsePriority(const std::string &name, unsigned int &priority) const;
+};
@@ -0,0 +1,353 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "metrics.hpp"
+#include "scheduler.hpp"
+#include "spdlog/spdlog.h"
+
+#include <limits>
+
+// a route's pass advances by this over its weight for each message served
+#define SCHEDULER_STRIDE    (1 << 20)
+
+Scheduler::Scheduler(const RouteTable &routes, std::chrono::seconds aging)
+    : m_Routes(routes), m_Aging(aging), m_Pass(0), m_Queued(0), m_Active(0), m_Flushing(false)
+{
+    const std::vector<std::string> &classes = m_Routes.Classes();
+    for (std::vector<std::string>::const_iterator i = classes.begin(); i != classes.end(); ++i)
+    {
+        std::string labels("{class=\"");
+        labels.append((*i)).append("\"}");
+
+        ClassMetrics metrics;
+        metrics.queued = &Metrics::Gauge("smtp_js_http_priority_queued" + labels,
+            "Messages waiting for a worker, per priority class");
+        metrics.dequeued = &Metrics::Counter("smtp_js_http_priority_dequeued_total" + labels,
+            "Messages handed to a worker, per priority class");
+        metrics.waited = &Metrics::Counter("smtp_js_http_priority_wait_milliseconds_total" + labels,
+            "Time messages spent waiting for a worker, per priority class");
+        m_ClassMetrics.push_back(metrics);
+    }
+}
+
+Scheduler::RouteQueue& Scheduler::Queue(const email &mail)
+{
+    const Route &route = m_Routes.ForRecipient(mail.to.empty() ? std::string() : mail.to.front());
+
+    std::map<std::string, RouteQueue>::iterator i = m_Queues.find(route.name);
+    if (i != m_Queues.end())
+        return i->second;
+
+    RouteQueue &queue = m_Queues[route.name];
+    queue.name = route.name;
+    queue.weight = (route.weight > 0 ? route.weight : 1);
+    queue.concurrency = route.concurrency;
+    queue.batchSize = (route.batchSize > 0 ? route.batchSize : 1);
+    queue.digest = route.IsDigest();
+    queue.digestWindow = std::chrono::seconds(route.digestWindow);
+    queue.digestCount = route.digestCount;
+    queue.active = 0;
+    queue.pass = m_Pass;
+    queue.queued = 0;
+    queue.classes.resize(m_Routes.Classes().size());
+
+    std::string labels("{route=\"");
+    labels.append(Metrics::Label(route.name)).append("\"}");
+    queue.queuedGauge = &Metrics::Gauge("smtp_js_http_route_queued" + labels,
+        "Messages waiting for a worker, per route");
+    queue.activeGauge = &Metrics::Gauge("smtp_js_http_route_active" + labels,
+        "Workers processing messages, per route");
+
+    return queue;
+}
+
+void Scheduler::Enqueue(const email &mail)
+{
+    const Route &route = m_Routes.ForRecipient(mail.to.empty() ? std::string() : mail.to.front());
+    unsigned int priority = m_Routes.Priority(route, mail.headers);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        RouteQueue &queue = Queue(mail);
+
+        // a route that has been idle doesn't get to bank the time it
+        // wasn't using, it starts level with the others
+        if (queue.queued == 0 && queue.pass < m_Pass)
+            queue.pass = m_Pass;
+
+        Item item;
+        item.mail = mail;
+        item.queued = std::chrono::steady_clock::now();
+        item.deadline = std::numeric_limits<int64_t>::max();
+        item.halfway = item.deadline;
+        if (route.maxAge > 0 && mail.received > 0)
+        {
+            item.deadline = mail.received + static_cast<int64_t>(route.maxAge) * 1000;
+            item.halfway = mail.received + static_cast<int64_t>(route.maxAge) * 500;
+        }
+        queue.classes[priority].push_back(item);
+        queue.queued++;
+
+        (*queue.queuedGauge)++;
+        (*m_ClassMetrics[priority].queued)++;
+        m_Queued++;
+    }
+
+    m_Ready.notify_one();
+}
+
+bool Scheduler::Dequeue(std::vector<email> &mails, std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    mails.clear();
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+    while (true)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int64_t wallNow = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+        // under pressure when something waiting is getting close to its
+        // deadline
+        bool pressure = false;
+        for (std::map<std::string, RouteQueue>::iterator i = m_Queues.begin(); i != m_Queues.end() && !pressure; ++i)
+        {
+            for (unsigned int c = 0; c < i->second.classes.size() && !pressure; ++c)
+            {
+                if (!i->second.classes[c].empty() && i->second.classes[c].front().halfway <= wallNow)
+                    pressure = true;
+            }
+        }
+
+        // the most urgent message, after aging, from the routes that have a
+        // worker to spare. between routes with messages that are as urgent,
+        // the one furthest behind its share goes first, or under pressure
+        // the one due first
+        RouteQueue *next = nullptr;
+        unsigned int nextClass = 0;
+        size_t nextUrgency = 0;
+        std::chrono::steady_clock::time_point wake = deadline;
+        for (std::map<std::string, RouteQueue>::iterator i = m_Queues.begin(); i != m_Queues.end(); ++i)
+        {
+            RouteQueue &queue = i->second;
+            if (queue.queued == 0 || (queue.concurrency > 0 && queue.active >= queue.concurrency))
+                continue;
+
+            if (queue.digest && !IsDigestDue(queue, now, wake))
+                continue;
+
+            // the oldest message of each class is the one aged the most
+            for (unsigned int c = 0; c < queue.classes.size(); ++c)
+            {
+                if (queue.classes[c].empty())
+                    continue;
+
+                size_t urgency = c;
+                if (m_Aging.count() > 0)
+                {
+                    size_t steps = static_cast<size_t>((now - queue.classes[c].front().queued) / m_Aging);
+                    urgency = (steps < urgency ? urgency - steps : 0);
+                }
+
+                if (next)
+                {
+                    if (urgency > nextUrgency)
+                        continue;
+
+                    if (urgency == nextUrgency && !(pressure ?
+                        queue.classes[c].front().deadline < next->classes[nextClass].front().deadline :
+                        queue.pass < next->pass))
+                        continue;
+                }
+
+                next = &queue;
+                nextClass = c;
+                nextUrgency = urgency;
+            }
+        }
+
+        if (next && next->digest)
+        {
+            TakeDigest(*next, now, mails);
+            return true;
+        }
+
+        if (next)
+        {
+            // messages that follow it to the same recipient come along, as
+            // long as the batch stays in order
+            std::deque<Item> &items = next->classes[nextClass];
+            const email &first = items.front().mail;
+            std::string to = (first.to.size() == 1 ? first.to.front() : std::string());
+
+            ClassMetrics &metrics = m_ClassMetrics[nextClass];
+            do
+            {
+                Item &item = items.front();
+                mails.push_back(item.mail);
+
+                (*metrics.queued)--;
+                (*metrics.dequeued)++;
+                (*metrics.waited) += std::chrono::duration_cast<std::chrono::milliseconds>(now - item.queued).count();
+
+                items.pop_front();
+                next->queued--;
+                (*next->queuedGauge)--;
+                m_Queued--;
+
+                next->pass += SCHEDULER_STRIDE / next->weight;
+            } while (!to.empty() && mails.size() < next->batchSize && !items.empty() &&
+                items.front().mail.to.size() == 1 && items.front().mail.to.front() == to);
+
+            next->active++;
+            (*next->activeGauge)++;
+            m_Active++;
+
+            m_Pass = next->pass;
+            return true;
+        }
+
+        // a digest's window may be up before anything else happens
+        if (m_Ready.wait_until(lock, wake) == std::cv_status::timeout && wake == deadline)
+            return false;
+    }
+}
+
+bool Scheduler::IsDigestDue(const RouteQueue &queue, std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wake) const
+{
+    if (m_Flushing || (queue.digestCount > 0 && queue.queued >= queue.digestCount))
+        return true;
+
+    if (queue.digestWindow.count() == 0)
+        return false;
+
+    for (std::vector<std::deque<Item>>::const_iterator c = queue.classes.begin(); c != queue.classes.end(); ++c)
+    {
+        if (c->empty())
+            continue;
+
+        if (now - c->front().queued >= queue.digestWindow)
+            return true;
+
+        if (c->front().queued + queue.digestWindow < wake)
+            wake = c->front().queued + queue.digestWindow;
+    }
+
+    return false;
+}
+
+void Scheduler::TakeDigest(RouteQueue &queue, std::chrono::steady_clock::time_point now,
+    std::vector<email> &mails)
+{
+    // everything for the same recipient as the oldest message, by class
+    // and in order, up to the digest count
+    std::string to;
+    std::chrono::steady_clock::time_point oldest = now;
+    for (std::vector<std::deque<Item>>::iterator c = queue.classes.begin(); c != queue.classes.end(); ++c)
+    {
+        if (!c->empty() && c->front().queued <= oldest && !c->front().mail.to.empty())
+        {
+            oldest = c->front().queued;
+            to = c->front().mail.to.front();
+        }
+    }
+
+    for (unsigned int c = 0; c < queue.classes.size(); ++c)
+    {
+        std::deque<Item> &items = queue.classes[c];
+        ClassMetrics &metrics = m_ClassMetrics[c];
+
+        while (!items.empty() && !items.front().mail.to.empty() && items.front().mail.to.front() == to &&
+            (queue.digestCount == 0 || mails.size() < queue.digestCount))
+        {
+            Item &item = items.front();
+            mails.push_back(item.mail);
+
+            (*metrics.queued)--;
+            (*metrics.dequeued)++;
+            (*metrics.waited) += std::chrono::duration_cast<std::chrono::milliseconds>(now - item.queued).count();
+
+            items.pop_front();
+            queue.queued--;
+            (*queue.queuedGauge)--;
+            m_Queued--;
+        }
+    }
+
+    queue.active++;
+    (*queue.activeGauge)++;
+    m_Active++;
+
+    m_Pass = queue.pass;
+    queue.pass += SCHEDULER_STRIDE / queue.weight;
+}
+
+void Scheduler::Done(const email &mail)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        RouteQueue &queue = Queue(mail);
+        queue.active--;
+        (*queue.activeGauge)--;
+        m_Active--;
+    }
+
+    // the route may have been held back by its concurrency limit
+    m_Ready.notify_one();
+}
+
+void Scheduler::Flush(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Flushing)
+            return;
+
+        m_Flushing = true;
+    }
+
+    m_Ready.notify_all();
+}
+
+size_t Scheduler::Queued(void)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Queued;
+}
+
+size_t Scheduler::Queued(const std::string &route)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    std::map<std::string, RouteQueue>::iterator i = m_Queues.find(route);
+    return (i != m_Queues.end() ? i->second.queued : 0);
+}
+
+size_t Scheduler::Active(void)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Active;
+}
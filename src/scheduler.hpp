@@ -0,0 +1,136 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "routes.hpp"
+#include "smtp.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Hands messages to the worker pool. Each route has its own queue, so mail
+// for one script never waits behind a backlog for another. Queues are
+// served in proportion to their route's weight (stride scheduling), and a
+// route never has more than its concurrency limit of workers at once, so a
+// route whose endpoint has slowed down can't take every worker.
+//
+// Within that, the message with the highest priority class goes first. A
+// message moves up a class for every 'aging' it has waited, so a backlog of
+// low priority mail is never starved for good. Once a waiting message has
+// used half of its route's max-age, routes are no longer taken in turn but
+// by the earliest deadline, to get through as much as possible in time.
+//
+// Routes in digest mode are held back until their window is up or enough
+// messages have arrived, and then all of those for the same recipient are
+// taken at once, to be handed to the script as one.
+class Scheduler
+{
+private:
+    struct Item
+    {
+        email mail;
+        std::chrono::steady_clock::time_point queued;
+
+        // milliseconds since the epoch, INT64_MAX without a max-age
+        int64_t deadline;
+        int64_t halfway;
+    };
+
+    struct RouteQueue
+    {
+        std::string name;
+        unsigned int weight;
+        unsigned int concurrency;   // 0 for no limit
+        unsigned int batchSize;
+
+        // a digest route's messages are held until the oldest has waited
+        // digestWindow, or there are digestCount of them, then all taken
+        bool digest;
+        std::chrono::steady_clock::duration digestWindow;
+        unsigned int digestCount;
+
+        unsigned int active;        // workers processing its messages
+        uint64_t pass;              // virtual time of the next message served
+        size_t queued;
+
+        std::vector<std::deque<Item>> classes;  // by priority class
+
+        std::atomic<int64_t> *queuedGauge;
+        std::atomic<int64_t> *activeGauge;
+    };
+
+    struct ClassMetrics
+    {
+        std::atomic<int64_t> *queued;
+        std::atomic<int64_t> *dequeued;
+        std::atomic<int64_t> *waited;       // milliseconds
+    };
+
+    const RouteTable &m_Routes;
+    std::chrono::steady_clock::duration m_Aging;    // zero to never promote
+    std::vector<ClassMetrics> m_ClassMetrics;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Ready;
+    std::map<std::string, RouteQueue> m_Queues;
+    uint64_t m_Pass;                // pass of the last message served
+    size_t m_Queued;
+    size_t m_Active;
+    bool m_Flushing;                // digests no longer wait
+
+public:
+    Scheduler(const RouteTable &routes, std::chrono::seconds aging);
+
+    // queue a message on the route of its first recipient, the one the
+    // script is chosen by
+    void Enqueue(const email &mail);
+
+    // takes the next messages to process, waiting up to 'timeout' for them.
+    // that is the next message and, up to the route's batch size, those
+    // queued right behind it for the same single recipient. once they have
+    // been processed, the first of them has to be handed back to Done()
+    bool Dequeue(std::vector<email> &mails, std::chrono::milliseconds timeout);
+    void Done(const email &mail);
+
+    // hands out the digests being collected without waiting any longer,
+    // for when no more mail is coming
+    void Flush(void);
+
+    // messages waiting, and batches being processed
+    size_t Queued(void);
+    size_t Queued(const std::string &route);
+    size_t Active(void);
+
+private:
+    RouteQueue& Queue(const email &mail);
+    bool IsDigestDue(const RouteQueue &queue, std::chrono::steady_clock::time_point now,
+        std::chrono::steady_clock::time_point &wake) const;
+    void TakeDigest(RouteQueue &queue, std::chrono::steady_clock::time_point now, std::vector<email> &mails);
+};
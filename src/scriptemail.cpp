@@ -0,0 +1,360 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "scriptemail.hpp"
+#include "digest.hpp"
+#include "dukglue/dukglue.h"
+
+// heap stash key holding every external buffer currently handed out
+#define EXTERNAL_BUFFERS    "\xFF" "externalBuffers"
+
+ScriptEmail::ScriptEmail(duk_context *vm, email &mail)
+    : m_VM(vm), m_Mail(mail), m_Walked(false)
+{
+}
+
+ScriptEmail::~ScriptEmail(void)
+{
+    for (std::vector<ScriptMimePart*>::iterator i = m_Parts.begin();
+        i != m_Parts.end(); ++i)
+    {
+        dukglue_invalidate_object(m_VM, (*i));
+        delete (*i);
+    }
+}
+
+MimePart* ScriptEmail::Mime(void)
+{
+    if (!m_Mime)
+        m_Mime.reset(new MimePart(m_Mail.headers, m_Mail.Body(), m_Mail.BodyLength()));
+
+    return m_Mime.get();
+}
+
+void ScriptEmail::Walk(void)
+{
+    if (!m_Walked)
+    {
+        m_Walked = true;
+        Mime()->Leaves(m_Leaves);
+    }
+}
+
+void ScriptEmail::Body(char *&ptr, size_t &len)
+{
+    // only pay for decoding if the body actually has a transfer encoding
+    MimePart *mime = Mime();
+    if (mime->IsMultipart() || mime->TransferEncoding() == MimePart::ENCODING_IDENTITY)
+    {
+        ptr = m_Mail.Body();
+        len = m_Mail.BodyLength();
+    }
+    else
+    {
+        std::string &content = mime->Content();
+        ptr = &content[0];
+        len = content.length();
+    }
+}
+
+const std::vector<ScriptMimePart*>& ScriptEmail::Parts(void)
+{
+    if (m_Parts.empty())
+    {
+        Walk();
+        for (std::vector<MimePart*>::iterator i = m_Leaves.begin();
+            i != m_Leaves.end(); ++i)
+            m_Parts.push_back(new ScriptMimePart(*(*i)));
+    }
+
+    return m_Parts;
+}
+
+MimePart* ScriptEmail::FirstOf(const char *contentType)
+{
+    Walk();
+    for (std::vector<MimePart*>::iterator i = m_Leaves.begin();
+        i != m_Leaves.end(); ++i)
+    {
+        if ((*i)->ContentType().compare(contentType) == 0 && !(*i)->IsAttachment())
+            return (*i);
+    }
+
+    return nullptr;
+}
+
+// pushes 'this' and returns the native object behind it
+template <typename T>
+static T* PushThis(duk_context *ctx)
+{
+    duk_push_this(ctx);
+
+    T *self = nullptr;
+    dukglue_read<T*>(ctx, -1, &self);
+    if (self == nullptr)
+        duk_error(ctx, DUK_ERR_REFERENCE_ERROR, "Object has been released");
+
+    return self;
+}
+
+// [... this value] -> [... this value]. Stores the value as a read-only own
+// property of 'this', shadowing the getter on the prototype.
+static duk_ret_t CacheResult(duk_context *ctx, const char *name)
+{
+    duk_push_string(ctx, name);
+    duk_dup(ctx, -2);
+    duk_def_prop(ctx, -4, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_HAVE_WRITABLE |
+        DUK_DEFPROP_SET_ENUMERABLE | DUK_DEFPROP_HAVE_CONFIGURABLE);
+
+    return 1;
+}
+
+static void PushString(duk_context *ctx, const std::string &str)
+{
+    duk_push_lstring(ctx, str.data(), str.length());
+}
+
+// a buffer object viewing memory owned by the message, no copy is made
+static void PushExternalBuffer(duk_context *ctx, char *ptr, size_t len)
+{
+    duk_push_external_buffer(ctx);
+    duk_config_buffer(ctx, -1, ptr, len);
+
+    duk_push_heap_stash(ctx);
+    if (!duk_get_prop_string(ctx, -1, EXTERNAL_BUFFERS))
+    {
+        duk_pop(ctx);
+        duk_push_array(ctx);
+        duk_dup_top(ctx);
+        duk_put_prop_string(ctx, -3, EXTERNAL_BUFFERS);
+    }
+
+    duk_dup(ctx, -3);
+    duk_put_prop_index(ctx, -2, static_cast<duk_uarridx_t>(duk_get_length(ctx, -2)));
+    duk_pop_2(ctx);
+}
+
+static duk_ret_t GetFrom(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+    PushString(ctx, self->Mail().from);
+    return CacheResult(ctx, "from");
+}
+
+static duk_ret_t GetDate(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+    PushString(ctx, self->Mail().date);
+    return CacheResult(ctx, "date");
+}
+
+static duk_ret_t GetSubject(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+    PushString(ctx, self->Mail().subject);
+    return CacheResult(ctx, "subject");
+}
+
+static duk_ret_t GetBody(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+
+    char *ptr;
+    size_t len;
+    self->Body(ptr, len);
+    duk_push_lstring(ctx, ptr, len);
+    return CacheResult(ctx, "body");
+}
+
+static duk_ret_t GetBodyBuffer(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+
+    char *ptr;
+    size_t len;
+    self->Body(ptr, len);
+    PushExternalBuffer(ctx, ptr, len);
+    return CacheResult(ctx, "bodyBuffer");
+}
+
+static duk_ret_t GetRaw(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+    PushExternalBuffer(ctx, self->Mail().Data(), self->Mail().DataLength());
+    return CacheResult(ctx, "raw");
+}
+
+static duk_ret_t GetText(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+    MimePart *part = self->FirstOf("text/plain");
+    if (part)
+        PushString(ctx, part->Content());
+    else
+        duk_push_string(ctx, "");
+    return CacheResult(ctx, "text");
+}
+
+static duk_ret_t GetHtml(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+    MimePart *part = self->FirstOf("text/html");
+    if (part)
+        PushString(ctx, part->Content());
+    else
+        duk_push_string(ctx, "");
+    return CacheResult(ctx, "html");
+}
+
+static duk_ret_t GetParts(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+
+    const std::vector<ScriptMimePart*> &parts = self->Parts();
+    duk_idx_t arr = duk_push_array(ctx);
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        dukglue_push(ctx, parts[i]);
+        duk_put_prop_index(ctx, arr, static_cast<duk_uarridx_t>(i));
+    }
+
+    return CacheResult(ctx, "parts");
+}
+
+// what a digest stands for, or null for an ordinary email
+static duk_ret_t GetDigest(duk_context *ctx)
+{
+    ScriptEmail *self = PushThis<ScriptEmail>(ctx);
+
+    const std::shared_ptr<const DigestInfo> &digest = self->Mail().digest;
+    if (!digest)
+    {
+        duk_push_null(ctx);
+        return CacheResult(ctx, "digest");
+    }
+
+    duk_idx_t obj = duk_push_object(ctx);
+    duk_push_number(ctx, static_cast<duk_double_t>(digest->count));
+    duk_put_prop_string(ctx, obj, "count");
+    duk_push_number(ctx, static_cast<duk_double_t>(digest->oldest));
+    duk_put_prop_string(ctx, obj, "oldest");
+    duk_push_number(ctx, static_cast<duk_double_t>(digest->newest));
+    duk_put_prop_string(ctx, obj, "newest");
+
+    duk_idx_t arr = duk_push_array(ctx);
+    for (size_t i = 0; i < digest->subjects.size(); ++i)
+    {
+        PushString(ctx, digest->subjects[i]);
+        duk_put_prop_index(ctx, arr, static_cast<duk_uarridx_t>(i));
+    }
+    duk_put_prop_string(ctx, obj, "subjects");
+
+    return CacheResult(ctx, "digest");
+}
+
+static duk_ret_t GetPartContentType(duk_context *ctx)
+{
+    ScriptMimePart *self = PushThis<ScriptMimePart>(ctx);
+    PushString(ctx, self->Part().ContentType());
+    return CacheResult(ctx, "contentType");
+}
+
+static duk_ret_t GetPartCharset(duk_context *ctx)
+{
+    ScriptMimePart *self = PushThis<ScriptMimePart>(ctx);
+    PushString(ctx, self->Part().Charset());
+    return CacheResult(ctx, "charset");
+}
+
+static duk_ret_t GetPartFilename(duk_context *ctx)
+{
+    ScriptMimePart *self = PushThis<ScriptMimePart>(ctx);
+    PushString(ctx, self->Part().Filename());
+    return CacheResult(ctx, "filename");
+}
+
+static duk_ret_t GetPartBody(duk_context *ctx)
+{
+    ScriptMimePart *self = PushThis<ScriptMimePart>(ctx);
+    PushString(ctx, self->Part().Content());
+    return CacheResult(ctx, "body");
+}
+
+static duk_ret_t GetPartBodyBuffer(duk_context *ctx)
+{
+    ScriptMimePart *self = PushThis<ScriptMimePart>(ctx);
+    std::string &content = self->Part().Content();
+    PushExternalBuffer(ctx, &content[0], content.length());
+    return CacheResult(ctx, "bodyBuffer");
+}
+
+// prototype is at the top of the stack
+static void DefineGetter(duk_context *ctx, duk_c_function getter, const char *name)
+{
+    duk_push_string(ctx, name);
+    duk_push_c_function(ctx, getter, 0);
+    duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_HAVE_CONFIGURABLE |
+        DUK_DEFPROP_FORCE);
+}
+
+void ScriptEmail::Register(duk_context *ctx)
+{
+    dukglue::detail::ProtoManager::push_prototype<ScriptEmail>(ctx);
+    DefineGetter(ctx, GetFrom, "from");
+    DefineGetter(ctx, GetDate, "date");
+    DefineGetter(ctx, GetSubject, "subject");
+    DefineGetter(ctx, GetBody, "body");
+    DefineGetter(ctx, GetBodyBuffer, "bodyBuffer");
+    DefineGetter(ctx, GetRaw, "raw");
+    DefineGetter(ctx, GetText, "text");
+    DefineGetter(ctx, GetHtml, "html");
+    DefineGetter(ctx, GetParts, "parts");
+    DefineGetter(ctx, GetDigest, "digest");
+    duk_pop(ctx);
+
+    dukglue::detail::ProtoManager::push_prototype<ScriptMimePart>(ctx);
+    DefineGetter(ctx, GetPartContentType, "contentType");
+    DefineGetter(ctx, GetPartCharset, "charset");
+    DefineGetter(ctx, GetPartFilename, "filename");
+    DefineGetter(ctx, GetPartBody, "body");
+    DefineGetter(ctx, GetPartBodyBuffer, "bodyBuffer");
+    duk_pop(ctx);
+}
+
+void ScriptEmail::ReleaseBuffers(duk_context *ctx)
+{
+    duk_push_heap_stash(ctx);
+    if (duk_get_prop_string(ctx, -1, EXTERNAL_BUFFERS))
+    {
+        duk_size_t count = duk_get_length(ctx, -1);
+        for (duk_size_t i = 0; i < count; ++i)
+        {
+            duk_get_prop_index(ctx, -1, static_cast<duk_uarridx_t>(i));
+            duk_config_buffer(ctx, -1, nullptr, 0);
+            duk_pop(ctx);
+        }
+    }
+    duk_pop(ctx);
+
+    duk_del_prop_string(ctx, -1, EXTERNAL_BUFFERS);
+    duk_pop(ctx);
+}
@@ -0,0 +1,86 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "duktape.h"
+
+#include "mime.hpp"
+#include "smtp.hpp"
+
+#include <memory>
+#include <vector>
+
+class ScriptMimePart
+{
+private:
+    MimePart &m_Part;
+
+public:
+    ScriptMimePart(MimePart &part) : m_Part(part) {}
+
+    MimePart& Part(void) { return m_Part; }
+};
+
+// The email object handed to scripts. Property values are produced on first
+// read and then stored on the JS object itself, so repeated reads never come
+// back into native code. Buffers handed out point straight at the message,
+// which is the worker's own copy, so a script may write to them without
+// anything reaching the spool or the sender.
+class ScriptEmail
+{
+private:
+    duk_context *m_VM;
+    email &m_Mail;
+
+    // the MIME structure is only parsed if the script asks for it
+    std::unique_ptr<MimePart> m_Mime;
+    std::vector<MimePart*> m_Leaves;
+    bool m_Walked;
+    std::vector<ScriptMimePart*> m_Parts;
+
+public:
+    ScriptEmail(duk_context *vm, email &mail);
+    ~ScriptEmail(void);
+
+    email& Mail(void) { return m_Mail; }
+
+    // the body with any transfer encoding removed. the memory belongs to
+    // the email or to this object
+    void Body(char *&ptr, size_t &len);
+
+    const std::vector<ScriptMimePart*>& Parts(void);
+
+    // first inline part of the given type, or nullptr
+    MimePart* FirstOf(const char *contentType);
+
+    // register the email and part properties with a VM
+    static void Register(duk_context *ctx);
+
+    // detach every buffer handed out since the last call, so a script
+    // that kept one around can't reach released message memory
+    static void ReleaseBuffers(duk_context *ctx);
+
+private:
+    MimePart* Mime(void);
+    void Walk(void);
+};
@@ -21,13 +21,21 @@
 // SOFTWARE.
 
 #include "scriptvm.hpp"
+#include "codec.hpp"
 #include "dukglue/dukglue.h"
+#include "scriptemail.hpp"
 #include "spdlog/spdlog.h"
 #include "webrequest.hpp"
 
 #include <fstream>
 #include <vector>
 
+// suffix of the optional entry point that takes a whole batch of emails
+#define BATCH_SUFFIX    "Batch"
+
+// heap stash key holding each request in flight and its callback
+#define ASYNC_REQUESTS  "\xFF" "asyncRequests"
+
 static void my_fatal(void *udata, const char *msg)
 {
     (void)udata;
@@ -54,19 +62,80 @@ static void my_debug(const char *msg)
     spdlog::debug(msg);
 }
 
-class ScriptEmail
+static std::string my_base64decode(const std::string &data)
+{
+    std::string decoded;
+    Base64Decode(data.data(), data.length(), decoded);
+    return decoded;
+}
+
+static std::string my_base64encode(const std::string &data)
+{
+    std::string encoded;
+    Base64Encode(data.data(), data.length(), encoded);
+    return encoded;
+}
+
+static std::string RequestKey(WebRequest *request)
+{
+    return std::to_string(reinterpret_cast<uintptr_t>(request));
+}
+
+// request.getAsync(url, callback) and request.postAsync(url, callback).
+// the callback is called with the request once it has finished, and until
+// then the request is kept alive by the stash. without a callback nothing
+// can read the result, so the response body isn't kept
+static duk_ret_t StartAsync(duk_context *ctx, bool post)
+{
+    std::string url(duk_require_string(ctx, 0));
+    bool callback = !duk_is_undefined(ctx, 1);
+    if (callback)
+        duk_require_function(ctx, 1);
+
+    duk_push_this(ctx);
+    WebRequest *self = nullptr;
+    dukglue_read<WebRequest*>(ctx, -1, &self);
+    if (self == nullptr)
+        duk_error(ctx, DUK_ERR_REFERENCE_ERROR, "Object has been released");
+
+    if (!callback)
+        self->SetKeepResult(false);
+
+    if (!self->Start(url, post))
+    {
+        duk_push_false(ctx);
+        return 1;
+    }
+
+    duk_push_heap_stash(ctx);
+    if (!duk_get_prop_string(ctx, -1, ASYNC_REQUESTS))
+    {
+        duk_pop(ctx);
+        duk_push_object(ctx);
+        duk_dup_top(ctx);
+        duk_put_prop_string(ctx, -3, ASYNC_REQUESTS);
+    }
+
+    duk_idx_t entry = duk_push_array(ctx);
+    duk_dup(ctx, -4);
+    duk_put_prop_index(ctx, entry, 0);
+    duk_dup(ctx, 1);
+    duk_put_prop_index(ctx, entry, 1);
+    duk_put_prop_string(ctx, -2, RequestKey(self).c_str());
+
+    duk_push_true(ctx);
+    return 1;
+}
+
+static duk_ret_t my_get_async(duk_context *ctx)
 {
-private:
-    const email &m_Mail;
+    return StartAsync(ctx, false);
+}
 
-public:
-    ScriptEmail(const email &mail) : m_Mail(mail) {}
-    
-    std::string getFrom(void) const { return m_Mail.from; }
-    std::string getDate(void) const { return m_Mail.date; }
-    std::string getSubject(void) const { return m_Mail.subject; }
-    std::string getBody(void) const { return m_Mail.body; }
-};
+static duk_ret_t my_post_async(duk_context *ctx)
+{
+    return StartAsync(ctx, true);
+}
 
 ScriptVM::ScriptVM(const std::string &scriptPath)
     : m_ScriptPath(scriptPath)
@@ -82,20 +151,31 @@ ScriptVM::ScriptVM(const std::string &scriptPath)
     dukglue_register_function(m_VM, my_warn, "warn");
     dukglue_register_function(m_VM, my_error, "error");
     dukglue_register_function(m_VM, my_debug, "debug");
+    dukglue_register_function(m_VM, my_base64decode, "base64Decode");
+    dukglue_register_function(m_VM, my_base64encode, "base64Encode");
 
     // register all script classes
-    dukglue_register_property(m_VM, &ScriptEmail::getFrom, nullptr, "from");
-    dukglue_register_property(m_VM, &ScriptEmail::getDate, nullptr, "date");
-    dukglue_register_property(m_VM, &ScriptEmail::getSubject, nullptr, "subject");
-    dukglue_register_property(m_VM, &ScriptEmail::getBody, nullptr, "body");
+    ScriptEmail::Register(m_VM);
 
-    dukglue_register_constructor<WebRequest>(m_VM, "WebRequest");
+    // deleted once the script drops it, which hands its curl handle back to
+    // the pool for the next request
+    dukglue_register_constructor_managed<WebRequest>(m_VM, "WebRequest");
     dukglue_register_method(m_VM, &WebRequest::Header, "header");
     dukglue_register_method(m_VM, &WebRequest::PostData, "data");
     dukglue_register_method(m_VM, &WebRequest::Get, "get");
     dukglue_register_method(m_VM, &WebRequest::Post, "post");
     dukglue_register_property(m_VM, &WebRequest::Result, nullptr, "result");
     dukglue_register_property(m_VM, &WebRequest::Error, nullptr, "error");
+    dukglue_register_property(m_VM, &WebRequest::KeepResult, &WebRequest::SetKeepResult, "keepResult");
+    dukglue_register_property(m_VM, &WebRequest::Retries, &WebRequest::SetRetries, "retries");
+    dukglue_register_property(m_VM, &WebRequest::Retrying, nullptr, "retrying");
+
+    dukglue::detail::ProtoManager::push_prototype<WebRequest>(m_VM);
+    duk_push_c_function(m_VM, my_get_async, 2);
+    duk_put_prop_string(m_VM, -2, "getAsync");
+    duk_push_c_function(m_VM, my_post_async, 2);
+    duk_put_prop_string(m_VM, -2, "postAsync");
+    duk_pop(m_VM);
 }
 
 ScriptVM::~ScriptVM(void)
@@ -106,69 +186,227 @@ ScriptVM::~ScriptVM(void)
         duk_destroy_heap(m_VM);
 }
 
-void ScriptVM::RunScript(const email &mail)
+bool ScriptVM::Load(const std::string &script)
+{
+    std::string _script(m_ScriptPath);
+    _script.append(script);
+
+    std::ifstream file(_script);
+    if (!file.is_open())
+    {
+        spdlog::warn("Failed to open script file '{}'", _script.c_str());
+        return false;
+    }
+
+    std::string content;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        content.append(line);
+        content.append("\n");
+    }
+
+    if (content.length() == 0)
+    {
+        spdlog::warn("Failed to read script file '{}'", _script.c_str());
+        return false;
+    }
+
+    duk_push_lstring(m_VM, content.c_str(), content.length());
+    if (duk_peval(m_VM) != 0)
+    {
+        spdlog::warn("Failed to compile script '{}': {}",
+            _script.c_str(), duk_safe_to_string(m_VM, -1));
+        duk_pop(m_VM);
+        return false;
+    }
+
+    duk_pop(m_VM);
+    return true;
+}
+
+duk_int_t ScriptVM::Call(const std::string &script, duk_idx_t nargs)
 {
+    WebRequest::ResetFailures();
+    duk_int_t result = duk_pcall(m_VM, nargs);
+    if (result != DUK_EXEC_SUCCESS)
+        spdlog::warn("Failed to execute script '{}{}': {}",
+            m_ScriptPath.c_str(), script.c_str(), duk_safe_to_string(m_VM, -1));
+
+    // the call isn't over until the requests it started have finished and
+    // their callbacks, which may start more, have run
+    WebRequest *request;
+    while (WebRequest::NextFinished(request))
+    {
+        if (!Callback(script, request) && result == DUK_EXEC_SUCCESS)
+            result = DUK_EXEC_ERROR;
+    }
+
+    return result;
+}
+
+bool ScriptVM::Callback(const std::string &script, WebRequest *request)
+{
+    std::string key = RequestKey(request);
+
+    duk_push_heap_stash(m_VM);
+    duk_get_prop_string(m_VM, -1, ASYNC_REQUESTS);
+    duk_get_prop_string(m_VM, -1, key.c_str());
+    duk_del_prop_string(m_VM, -2, key.c_str());
+
+    // [stash requests entry] -> [stash requests entry callback request]
+    duk_get_prop_index(m_VM, -1, 1);
+    duk_get_prop_index(m_VM, -2, 0);
+
+    bool ok = true;
+    if (!duk_is_function(m_VM, -2))
+    {
+        // started without a callback
+        duk_pop_n(m_VM, 5);
+        return ok;
+    }
+
+    if (duk_pcall(m_VM, 1) != DUK_EXEC_SUCCESS)
+    {
+        spdlog::warn("Failed to execute callback in script '{}{}': {}",
+            m_ScriptPath.c_str(), script.c_str(), duk_safe_to_string(m_VM, -1));
+        ok = false;
+    }
+
+    duk_pop_n(m_VM, 4);
+    return ok;
+}
+
+bool ScriptVM::Outcome(duk_int_t result, duk_idx_t idx)
+{
+    if (result != DUK_EXEC_SUCCESS)
+        return false;
+
+    // an explicit result overrides the state of any requests
+    if (duk_is_boolean(m_VM, idx))
+        return duk_get_boolean(m_VM, idx) != 0;
+
+    return (WebRequest::Failures() == 0);
+}
+
+bool ScriptVM::RunScript(email &mail)
+{
+    bool ok = true;
+
     for (std::vector<std::string>::const_iterator to = mail.to.begin();
         to != mail.to.end(); ++to)
     {
         std::string::size_type _at = (*to).find('@');
         if (_at == std::string::npos)
+        {
+            ok = false;
             continue;   // invalid
+        }
 
         std::string method = (*to).substr(0, _at);
         std::string script = (*to).substr(_at + 1);
 
-        std::string _script(m_ScriptPath);
-        _script.append(script);
+        spdlog::info("Calling method '{}' in file {}{}", method.c_str(), m_ScriptPath.c_str(), script.c_str());
 
-        spdlog::info("Calling method '{}' in file {}", method.c_str(), _script.c_str());
+        if (!Load(script))
+        {
+            ok = false;
+            continue;
+        }
+
+        duk_get_global_string(m_VM, method.c_str());
+        ScriptEmail *smail = new ScriptEmail(m_VM, mail);
+        dukglue_push(m_VM, smail);
+
+        if (!Outcome(Call(script, 1), -1))
+            ok = false;
 
-        std::ifstream file(_script);
-        if (!file.is_open())
-            spdlog::warn("Failed to open script file '{}'", _script.c_str());
-        else
+        duk_pop(m_VM);
+        ScriptEmail::ReleaseBuffers(m_VM);
+        dukglue_invalidate_object(m_VM, smail);
+        delete smail;
+    }
+
+    return ok;
+}
+
+void ScriptVM::RunBatch(std::vector<email> &mails, std::vector<bool> &results)
+{
+    results.assign(mails.size(), false);
+    if (mails.empty())
+        return;
+
+    // everything in a batch has the same single recipient
+    const std::string &to = mails.front().to.front();
+    std::string::size_type _at = to.find('@');
+    if (_at == std::string::npos)
+        return;
+
+    std::string method = to.substr(0, _at);
+    std::string script = to.substr(_at + 1);
+
+    if (!Load(script))
+        return;
+
+    std::string batch(method);
+    batch.append(BATCH_SUFFIX);
+
+    duk_get_global_string(m_VM, batch.c_str());
+    if (!duk_is_function(m_VM, -1))
+    {
+        duk_pop(m_VM);
+
+        // no batch entry point, the script is only compiled once though
+        for (size_t i = 0; i < mails.size(); ++i)
         {
-            std::string content;
-            std::string line;
-            while (std::getline(file, line))
-            {
-                content.append(line);
-                content.append("\n");
-            }
-
-            if (content.length() > 0)
-            {
-                duk_push_lstring(m_VM, content.c_str(), content.length());
-                if (duk_peval(m_VM) != 0)
-                {
-                    spdlog::warn("Failed to compile script '{}': {}",
-                        _script.c_str(), duk_safe_to_string(m_VM, -1));
-                }
-                else
-                {
-                    duk_pop(m_VM);
-
-                    duk_push_global_object(m_VM);
-                    duk_get_prop_string(m_VM, -1, method.c_str());
-                    ScriptEmail *smail = new ScriptEmail(mail);
-                    dukglue_push(m_VM, smail);
-                    
-                    duk_int_t result = duk_pcall(m_VM, 1);
-                    if (result != DUK_EXEC_SUCCESS)
-                    {
-                        spdlog::warn("Failed to execute script '{}': {}",
-                            _script.c_str(), duk_safe_to_string(m_VM, -1));
-                    }
-
-                    duk_pop(m_VM);
-                    delete smail;
-                }
-            }
-            else
-            {
-                spdlog::warn("Failed to read script file '{}'", _script.c_str());
-            }
-            
+            spdlog::info("Calling method '{}' in file {}{}", method.c_str(), m_ScriptPath.c_str(), script.c_str());
+
+            duk_get_global_string(m_VM, method.c_str());
+            ScriptEmail *smail = new ScriptEmail(m_VM, mails[i]);
+            dukglue_push(m_VM, smail);
+
+            results[i] = Outcome(Call(script, 1), -1);
+
+            duk_pop(m_VM);
+            ScriptEmail::ReleaseBuffers(m_VM);
+            dukglue_invalidate_object(m_VM, smail);
+            delete smail;
         }
+
+        return;
+    }
+
+    spdlog::info("Calling method '{}' in file {}{} with {} email(s)", batch.c_str(), m_ScriptPath.c_str(),
+        script.c_str(), mails.size());
+
+    std::vector<ScriptEmail*> smails;
+    duk_idx_t arr = duk_push_array(m_VM);
+    for (size_t i = 0; i < mails.size(); ++i)
+    {
+        smails.push_back(new ScriptEmail(m_VM, mails[i]));
+        dukglue_push(m_VM, smails.back());
+        duk_put_prop_index(m_VM, arr, static_cast<duk_uarridx_t>(i));
+    }
+
+    // true or false for the whole batch, or an array with one per email
+    duk_int_t result = Call(script, 1);
+    if (result == DUK_EXEC_SUCCESS && duk_is_array(m_VM, -1))
+    {
+        for (size_t i = 0; i < mails.size(); ++i)
+        {
+            duk_get_prop_index(m_VM, -1, static_cast<duk_uarridx_t>(i));
+            results[i] = Outcome(result, -1);
+            duk_pop(m_VM);
+        }
+    }
+    else
+        results.assign(mails.size(), Outcome(result, -1));
+
+    duk_pop(m_VM);
+    ScriptEmail::ReleaseBuffers(m_VM);
+    for (std::vector<ScriptEmail*>::iterator i = smails.begin(); i != smails.end(); ++i)
+    {
+        dukglue_invalidate_object(m_VM, (*i));
+        delete (*i);
     }
 }
@@ -25,7 +25,16 @@
 #include "duktape.h"
 
 #include "smtp.hpp"
+#include "webrequest.hpp"
 #include <string>
+#include <vector>
+
+// stack of the fiber each script runs on. it has to hold as much as
+// Duktape's own recursion limits allow (1000 native calls, at several KB
+// each without optimisation), so that a script recursing too deeply gets
+// a RangeError rather than running into the guard page. only the pages
+// that are used are committed
+#define SCRIPT_STACK_SIZE       (16 * 1024 * 1024)
 
 class ScriptVM
 {
@@ -38,5 +47,19 @@ public:
     ScriptVM(const std::string &scriptPath);
     virtual ~ScriptVM(void);
 
-    void RunScript(const email &mail);
+    // false if any of the scripts failed: it couldn't be run, threw, returned
+    // false, or returned nothing after an HTTP request failed
+    bool RunScript(email &mail);
+
+    // runs a batch of emails with the same single recipient, e.g.
+    // main@opsgenie.js. if the script has a mainBatch function it is called
+    // once with an array of them, otherwise main is called for each.
+    // 'results' has the outcome for each email, as for RunScript
+    void RunBatch(std::vector<email> &mails, std::vector<bool> &results);
+
+private:
+    bool Load(const std::string &script);
+    duk_int_t Call(const std::string &script, duk_idx_t nargs);
+    bool Callback(const std::string &script, WebRequest *request);
+    bool Outcome(duk_int_t result, duk_idx_t idx);
 };
@@ -28,13 +28,32 @@
 
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <curl/curl.h>
+#include <map>
+#include <memory>
+#include <set>
 #include <signal.h>
+#include <sys/socket.h>
 #include <systemd/sd-daemon.h>
 #include <thread>
-
+#include <vector>
+
+#include "backlog.hpp"
+#include "breaker.hpp"
+#include "dedup.hpp"
+#include "digest.hpp"
+#include "expiry.hpp"
+#include "fiber.hpp"
+#include "handoff.hpp"
+#include "hostlimits.hpp"
+#include "journal.hpp"
+#include "metrics.hpp"
+#include "retry.hpp"
+#include "scheduler.hpp"
 #include "scriptvm.hpp"
 #include "smtp.hpp"
+#include "webrequest.hpp"
 
 #define DEFAULT_CONF_PATH       "/etc/smtp-js-http/smtp-js-http.conf"
 #define DEFAULT_SMTP_ADDR       "127.0.0.1"
@@ -42,8 +61,38 @@
 #define DEFAULT_SCRIPT_PATH     "/usr/share/smtp-js-http"
 #define DEFAULT_LOG_FILE        "syslog"
 #define DEFAULT_LOG_LEVEL       "info"
-
-std::atomic_bool g_Running(false);
+#define DEFAULT_SPOOL_PATH      "/var/spool/smtp-js-http"
+#define DEFAULT_SPOOL_THRESHOLD 1048576
+#define DEFAULT_JOURNAL_PATH    "/var/lib/smtp-js-http"
+#define DEFAULT_JOURNAL_SEGMENT 16777216
+#define DEFAULT_ACK_MODE        "durable"
+#define DEFAULT_DRAIN_TIMEOUT   30
+#define DEFAULT_HANDOFF_PATH    "/run/smtp-js-http/handoff.sock"
+#define DEFAULT_QUEUE_MESSAGES  10000
+#define DEFAULT_QUEUE_BYTES     268435456
+#define DEFAULT_WORKERS         4
+#define DEFAULT_WORKER_SCRIPTS  16
+#define DEFAULT_PRIORITY_AGING  60
+#define DEFAULT_EXPIRED         "dead-letter"
+#define DEFAULT_DEAD_LETTER     "/var/spool/smtp-js-http/dead-letter"
+#define DEFAULT_DEDUP_KEY       "content"
+#define DEFAULT_DEDUP_ENTRIES   10000
+#define DEFAULT_HTTP_DNS_TTL    60
+#define DEFAULT_HTTP_MAX_RESP   16777216
+#define DEFAULT_RETRY_PATH      "/var/spool/smtp-js-http/retry"
+#define DEFAULT_RETRY_DELAY     5
+#define DEFAULT_RETRY_MAX_DELAY 600
+#define DEFAULT_BREAKER_WINDOW  20
+#define DEFAULT_BREAKER_OPEN    30
+
+// how often the metrics file is rewritten
+#define METRICS_INTERVAL        std::chrono::seconds(5)
+
+// how often a worker with scripts waiting for HTTP looks for new mail
+#define TASK_POLL_MS            10
+
+std::atomic_bool g_Running(false);     // accepting new mail
+std::atomic_bool g_Processing(false);  // workers are taking mail off the queue
 
 void signal_handler(int signo)
 {
@@ -65,24 +114,224 @@ void signal_handler(int signo)
     }
 }
 
-void ThreadProc(const std::string &scriptPath, moodycamel::ConcurrentQueue<email> &queue)
+// runs each script on the summary of its expired messages on 'route', if
+// any. an empty 'script' does so for every script on the route
+void RunSummaries(const std::string &scriptPath, Expiry &expiry, const std::string &route,
+    const std::string &script)
+{
+    while (true)
+    {
+        email summary;
+        if (!expiry.TakeSummary(route, script, summary))
+            break;
+
+        spdlog::info("Processing summary of expired email to {}", summary.to.front().c_str());
+
+        std::unique_ptr<ScriptVM> vm(new ScriptVM(scriptPath));
+        vm->RunScript(summary);
+    }
+}
+
+// processes one batch of messages taken off the queue
+void ProcessBatch(std::vector<email> &mails, const std::string &scriptPath, Scheduler &queue,
+    ReplyQueue &replies, Backlog &backlog, Journal *journal, const RouteTable &routes, Expiry &expiry,
+    Dedup &dedup)
+{
+    static std::atomic<int64_t> &batches = Metrics::Counter("smtp_js_http_batches_total",
+        "Batches of more than one email handed to a script");
+    static std::atomic<int64_t> &batched = Metrics::Counter("smtp_js_http_batched_emails_total",
+        "Emails handed to a script as part of a batch");
+    static std::atomic<int64_t> &digests = Metrics::Counter("smtp_js_http_digests_total",
+        "Digests handed to a script");
+    static std::atomic<int64_t> &digested = Metrics::Counter("smtp_js_http_digested_emails_total",
+        "Emails handed to a script as part of a digest");
+
+    const Route &route = routes.ForRecipient(mails.front().to.front());
+    std::vector<bool> results(mails.size(), false);
+
+    // spooled messages that couldn't be loaded are left in the journal and
+    // the spool, to be tried again at the next start
+    std::vector<bool> unloaded(mails.size(), false);
+
+    WebRequest::SetDefaultRetries(route.retries);
+
+    // the ones that are still wanted, and where their result goes
+    std::vector<email> run;
+    std::vector<size_t> index;
+    std::vector<uint64_t> keys;
+    bool expired = false;
+
+    for (size_t i = 0; i < mails.size(); ++i)
+    {
+        email &mail = mails[i];
+        spdlog::debug("Processing email to {}", mail.to.front().c_str());
+
+        if (!mail.spoolFile.empty())
+        {
+            mail.mapped.reset(new MappedFile);
+            if (!mail.mapped->Map(mail.spoolFile))
+            {
+                spdlog::error("Unable to load spooled email to {}", mail.to.front().c_str());
+                mail.mapped.reset();
+                unloaded[i] = true;
+                continue;
+            }
+        }
+
+        uint64_t key = 0;
+        if (expiry.IsExpired(route, mail))
+        {
+            results[i] = expiry.Handle(route, mail);
+            expired = true;
+        }
+        else if (dedup.IsDuplicate(route, mail, key))
+        {
+            spdlog::debug("Dropping repeated email to {}", mail.to.front().c_str());
+            results[i] = true;
+        }
+        else
+        {
+            run.push_back(mail);
+            index.push_back(i);
+            keys.push_back(key);
+        }
+    }
+
+    // what expired before these messages is older news, otherwise
+    // it's summarised once the route has caught up. the default route is
+    // shared, so then that goes for every script on it
+    bool caughtUp = (queue.Queued(route.name) == 0);
+    if (!run.empty() || (expired && caughtUp))
+        RunSummaries(scriptPath, expiry, route.name,
+            caughtUp ? std::string() : ScriptOf(mails.front().to.front()));
+
+    if (!run.empty())
+    {
+        std::unique_ptr<ScriptVM> vm(new ScriptVM(scriptPath));
+        if (route.IsDigest())
+        {
+            digests++;
+            digested += static_cast<int64_t>(run.size());
+
+            // the script sees one email standing for all of them
+            Digest digest;
+            for (size_t i = 0; i < run.size(); ++i)
+                digest.Add(run[i]);
+
+            email aggregate;
+            digest.Build(std::to_string(digest.Count()) + " message(s)", "X-Digest-", aggregate);
+            spdlog::info("Processing digest of {} email(s) to {}", digest.Count(),
+                aggregate.to.front().c_str());
+
+            bool result = vm->RunScript(aggregate);
+            for (size_t i = 0; i < run.size(); ++i)
+                results[index[i]] = result;
+        }
+        else if (run.size() == 1)
+            results[index.front()] = vm->RunScript(run.front());
+        else
+        {
+            batches++;
+            batched += static_cast<int64_t>(run.size());
+
+            std::vector<bool> outcome;
+            vm->RunBatch(run, outcome);
+            for (size_t i = 0; i < run.size(); ++i)
+                results[index[i]] = outcome[i];
+        }
+
+        // only what got through counts as seen, a failed message may be sent again
+        for (size_t i = 0; i < run.size(); ++i)
+        {
+            if (results[index[i]])
+                dedup.Remember(route, keys[i]);
+            else
+                dedup.Forget(keys[i]);
+        }
+    }
+
+    for (size_t i = 0; i < mails.size(); ++i)
+    {
+        email &mail = mails[i];
+
+        if (journal && mail.id != 0 && !unloaded[i])
+            journal->Complete(mail.id);
+
+        // the sender is still waiting for the outcome
+        if (mail.replyToken >= 0)
+            replies.Post(mail.replyToken, results[i]);
+
+        backlog.Remove(mail.data.length());
+
+        // the mapping stays valid after the unlink until it's released
+        if (!mail.spoolFile.empty() && !unloaded[i])
+            unlink(mail.spoolFile.c_str());
+    }
+
+    queue.Done(mails.front());
+}
+
+// A batch being processed by a worker, on a stack of its own so that it can
+// be put aside while its script waits for HTTP
+struct Task
+{
+    std::unique_ptr<Fiber> fiber;
+    RequestContext requests;
+};
+
+static bool Resume(Task &task)
+{
+    WebRequest::SetContext(&task.requests);
+    bool running = task.fiber->Resume();
+    WebRequest::SetContext(nullptr);
+
+    return running;
+}
+
+void ThreadProc(const std::string &scriptPath, Scheduler &queue, ReplyQueue &replies,
+    Backlog &backlog, Journal *journal, const RouteTable &routes, Expiry &expiry, Dedup &dedup,
+    size_t maxTasks)
 {
     spdlog::debug("Processing thread started");
 
     try
     {
-        while (g_Running)
+        // batches whose scripts are waiting for HTTP, by their requests
+        std::map<RequestContext*, std::unique_ptr<Task>> tasks;
+
+        while (g_Processing || !tasks.empty())
         {
-            email mail;
-            if (queue.try_dequeue(mail))
+            // take on more while there is room, without waiting for them
+            // while there are scripts to get back to
+            std::vector<email> mails;
+            if (g_Processing && tasks.size() < maxTasks &&
+                queue.Dequeue(mails, std::chrono::milliseconds(tasks.empty() ? 50 : 0)))
             {
-                spdlog::debug("Processing email to {}", mail.to.front().c_str());
-                std::unique_ptr<ScriptVM> vm(new ScriptVM(scriptPath));
-                vm->RunScript(mail);
+                std::unique_ptr<Task> task(new Task);
+                task->fiber.reset(new Fiber([&, mails]() mutable
+                    {
+                        ProcessBatch(mails, scriptPath, queue, replies, backlog, journal, routes, expiry, dedup);
+                    }, SCRIPT_STACK_SIZE));
+
+                if (Resume(*task))
+                    tasks[&task->requests] = std::move(task);
+                continue;
+            }
+
+            if (tasks.empty())
+                continue;
+
+            // with room for more, new mail is looked for now and then
+            std::vector<RequestContext*> ready;
+            WebRequest::Collect(std::chrono::milliseconds(tasks.size() < maxTasks && g_Processing ?
+                TASK_POLL_MS : 50), ready);
+
+            for (std::vector<RequestContext*>::iterator i = ready.begin(); i != ready.end(); ++i)
+            {
+                std::map<RequestContext*, std::unique_ptr<Task>>::iterator task = tasks.find((*i));
+                if (task != tasks.end() && !Resume(*task->second))
+                    tasks.erase(task);
             }
-            else
-                //std::this_thread::yield();
-                std::this_thread::sleep_for(std::chrono::milliseconds(50));
         }
     }
     catch (std::exception &e)
@@ -190,22 +439,284 @@ int main(int argc, char **argv)
 
         spdlog::info("Using script path: {}", scriptPath.c_str());
 
-        moodycamel::ConcurrentQueue<email> mailqueue;
-        SMTPServer smtp(mailqueue);
+        // large messages are written to disk while they're received
+        SMTPOptions options;
+        options.spoolPath = conf.Get("smtp-js-http", "spool-path", DEFAULT_SPOOL_PATH);
+        options.spoolThreshold = static_cast<size_t>(conf.GetInteger("smtp-js-http", "spool-threshold",
+            DEFAULT_SPOOL_THRESHOLD));
+
+        // when the reply to DATA is sent, per route or for the listener
+        Route defaults;
+        std::string ackMode = conf.Get("smtp-js-http", "ack-mode", DEFAULT_ACK_MODE);
+        if (!ParseAckMode(ackMode, defaults.ackMode))
+            throw std::runtime_error("Invalid ack-mode: " + ackMode);
+
+        // each worker runs several scripts at once, getting on with the
+        // others while one waits for HTTP. by default one route can hold at
+        // most half of them, so the others keep moving while its endpoint is
+        // slow
+        long workers = conf.GetInteger("smtp-js-http", "workers", DEFAULT_WORKERS);
+        if (workers < 1)
+            workers = 1;
+        long scripts = conf.GetInteger("smtp-js-http", "worker-scripts", DEFAULT_WORKER_SCRIPTS);
+        if (scripts < 1)
+            scripts = 1;
+        defaults.weight = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "weight", 1));
+        defaults.concurrency = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "concurrency",
+            (workers * scripts + 1) / 2));
+
+        // messages queued together for the same recipient can go to the
+        // script in one call
+        defaults.batchSize = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "batch-size", 1));
+
+        // what becomes of messages that have waited too long
+        defaults.maxAge = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "max-age", 0));
+        std::string expired = conf.Get("smtp-js-http", "expired", DEFAULT_EXPIRED);
+        if (!ParseExpireAction(expired, defaults.expired))
+            throw std::runtime_error("Invalid expired action: " + expired);
+
+        Expiry expiry(conf.Get("smtp-js-http", "dead-letter-path", DEFAULT_DEAD_LETTER));
+
+        // repeats of a message seen recently are dropped
+        defaults.dedupWindow = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "dedup-window", 0));
+        std::string dedupKey = conf.Get("smtp-js-http", "dedup-key", DEFAULT_DEDUP_KEY);
+        if (!ParseDedupKey(dedupKey, defaults.dedupKey))
+            throw std::runtime_error("Invalid dedup-key: " + dedupKey);
+
+        Dedup dedup(static_cast<size_t>(conf.GetInteger("smtp-js-http", "dedup-entries",
+            DEFAULT_DEDUP_ENTRIES)));
+
+        defaults.retries = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "http-retries", 0));
+
+        RouteTable routes(conf, defaults);
+
+        // take the listener over from a running instance if there is one.
+        // it keeps draining, so its journal and spool files are left alone
+        Handoff handoff;
+        bool upgraded = false;
+        bool handedOff = false;
+        int listener = -1;
+
+        std::string hpath = conf.Get("smtp-js-http", "handoff-path", DEFAULT_HANDOFF_PATH);
+        if (!hpath.empty())
+        {
+            listener = handoff.Receive(hpath);
+            upgraded = (listener != -1);
+        }
+
+        if (listener == -1 && sd_listen_fds(1) > 0)
+        {
+            if (sd_is_socket(SD_LISTEN_FDS_START, AF_UNSPEC, SOCK_STREAM, 1) > 0)
+            {
+                spdlog::info("Using the listening socket passed by systemd");
+                listener = SD_LISTEN_FDS_START;
+            }
+            else
+                spdlog::warn("Ignoring the socket passed by systemd, it is not a listening stream socket");
+        }
+
+        // lower priority mail moves up a class each time it has waited this long
+        Scheduler mailqueue(routes, std::chrono::seconds(conf.GetInteger("smtp-js-http", "priority-aging",
+            DEFAULT_PRIORITY_AGING)));
+        ReplyQueue replies;
+
+        // new mail is turned away once too much is waiting to be processed
+        Backlog backlog(static_cast<size_t>(conf.GetInteger("smtp-js-http", "queue-max-messages",
+            DEFAULT_QUEUE_MESSAGES)), static_cast<size_t>(conf.GetInteger("smtp-js-http", "queue-max-bytes",
+            DEFAULT_QUEUE_BYTES)));
+
+        // accepted messages are written to the journal before they are
+        // acknowledged, anything left unprocessed by an earlier run is replayed
+        Journal journal(mailqueue, replies, backlog);
+        Journal *pjournal = nullptr;
+        std::set<std::string> keep;
+
+        std::string jpath = conf.Get("smtp-js-http", "journal-path", DEFAULT_JOURNAL_PATH);
+        if (jpath.empty())
+        {
+            spdlog::warn("Journal disabled, accepted messages are only held in memory");
+            if (defaults.ackMode == ACK_DURABLE)
+                spdlog::warn("Durable acknowledgement needs the journal, using queued");
+        }
+        else if (journal.Open(jpath, static_cast<size_t>(conf.GetInteger("smtp-js-http",
+            "journal-segment-size", DEFAULT_JOURNAL_SEGMENT))))
+        {
+            pjournal = &journal;
+
+            size_t recovered = journal.Recover(keep);
+            if (recovered > 0)
+                spdlog::info("Replaying {} unprocessed message(s)", recovered);
+        }
+        else
+            throw std::runtime_error("Unable to open journal");
+
+        if (options.spoolThreshold > 0)
+        {
+            if (PrepareSpool(options.spoolPath))
+            {
+                spdlog::info("Spooling messages over {} bytes to {}", options.spoolThreshold,
+                    options.spoolPath.c_str());
+            }
+            else
+            {
+                spdlog::warn("Spool path {} is unusable, large messages will be kept in memory",
+                    options.spoolPath.c_str());
+                options.spoolThreshold = 0;
+            }
+        }
+
+        SMTPServer smtp(mailqueue, options, replies, backlog, routes, pjournal);
 
         if (curl_global_init(CURL_GLOBAL_ALL) != 0)
             throw std::runtime_error("Unable to initialize cURL library");
 
-        if (!smtp.Start(addr, port))
+        // web requests that failed are saved and sent again from here,
+        // including those left over from the last run
+        RetryQueue retries(std::chrono::seconds(conf.GetInteger("smtp-js-http", "http-retry-delay",
+            DEFAULT_RETRY_DELAY)), std::chrono::seconds(conf.GetInteger("smtp-js-http", "http-retry-max-delay",
+            DEFAULT_RETRY_MAX_DELAY)));
+        RetryQueue *pretries = nullptr;
+
+        std::string rpath = conf.Get("smtp-js-http", "http-retry-path", DEFAULT_RETRY_PATH);
+        if (rpath.empty())
+            spdlog::info("Retry path not set, failed web requests won't be retried");
+        else if (retries.Open(rpath))
+        {
+            pretries = &retries;
+
+            size_t recovered = retries.Recover();
+            if (recovered > 0)
+                spdlog::info("Resuming {} web request retries", recovered);
+        }
+        else
+            spdlog::warn("Retry path {} is unusable, failed web requests won't be retried", rpath.c_str());
+
+        // requests to a host that keeps failing fail fast for a while
+        BreakerOptions breaker;
+        breaker.threshold = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "http-breaker-threshold", 0));
+        breaker.requests = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "http-breaker-requests",
+            DEFAULT_BREAKER_WINDOW));
+        breaker.slow = std::chrono::milliseconds(conf.GetInteger("smtp-js-http", "http-breaker-slow", 0));
+        breaker.open = std::chrono::seconds(conf.GetInteger("smtp-js-http", "http-breaker-open",
+            DEFAULT_BREAKER_OPEN));
+        Breakers breakers(breaker);
+
+        // and none is hit harder than its limits allow
+        HostLimit hostDefaults;
+        hostDefaults.concurrency = static_cast<unsigned int>(conf.GetInteger("smtp-js-http",
+            "http-host-concurrency", 0));
+        hostDefaults.rate = conf.GetReal("smtp-js-http", "http-host-rate", 0);
+        hostDefaults.burst = static_cast<unsigned int>(conf.GetInteger("smtp-js-http", "http-host-burst", 0));
+        HostLimits limits(conf, hostDefaults);
+
+        HttpOptions http;
+        http.dnsTtl = conf.GetInteger("smtp-js-http", "http-dns-ttl", DEFAULT_HTTP_DNS_TTL);
+        http.http2 = conf.GetBoolean("smtp-js-http", "http2", false);
+        http.maxResponse = static_cast<size_t>(conf.GetInteger("smtp-js-http", "http-max-response",
+            DEFAULT_HTTP_MAX_RESP));
+        http.retries = pretries;
+        http.breakers = &breakers;
+        http.limits = &limits;
+
+        if (!WebRequest::Init(http))
+            throw std::runtime_error("Unable to initialize cURL share");
+
+        if (pretries)
+            pretries->Start();
+
+        if (listener != -1)
+            smtp.Adopt(listener);
+        else if (!smtp.Start(addr, port))
             throw std::runtime_error("Unable to start SMTP server");
 
+        // stale spool files only go once the port is ours, so a second
+        // instance that can't have it leaves the running one's files alone.
+        // they also stay while another process has a live journal
+        if (options.spoolThreshold > 0 && !upgraded && !(pjournal && pjournal->OthersRunning()))
+            CleanSpool(options.spoolPath, keep);
+
+        // wait for a successor to take over from us. we only stop once it
+        // says it is serving, if it fails to start we keep going
+        std::function<void(void)> awaitSuccessor = [&]()
+        {
+            int fd = handoff.ListenerFd();
+            if (!handoff.Send(smtp.Listener()))
+                return;
+
+            spdlog::info("Handed the listener over to a new process");
+            smtp.Unwatch(fd);
+
+            smtp.Watch(handoff.PeerFd(), [&]()
+            {
+                smtp.Unwatch(handoff.PeerFd());
+                if (handoff.Confirm())
+                {
+                    spdlog::info("New process is serving, stopping");
+                    handedOff = true;
+                    g_Running.store(false);
+                }
+                else
+                {
+                    spdlog::warn("New process failed to start, carrying on");
+                    handoff.Close();
+                    if (handoff.Listen(hpath))
+                        smtp.Watch(handoff.ListenerFd(), awaitSuccessor);
+                }
+            });
+        };
+
+        if (!hpath.empty() && handoff.Listen(hpath))
+            smtp.Watch(handoff.ListenerFd(), awaitSuccessor);
+
+        // once the predecessor has exited, whatever it didn't get to is ours
+        if (upgraded)
+        {
+            smtp.Watch(handoff.PeerFd(), [&]()
+            {
+                char ch;
+                if (recv(handoff.PeerFd(), &ch, sizeof(ch), 0) > 0)
+                    return;
+
+                spdlog::info("Previous process has exited");
+                smtp.Unwatch(handoff.PeerFd());
+                handoff.ClosePeer();
+
+                std::set<std::string> files;
+                if (pjournal)
+                    pjournal->Recover(files);
+            });
+        }
+
         if (daemon)
-            sd_notify(0, "READY=1");
+        {
+            if (upgraded)
+                sd_notifyf(0, "READY=1\nMAINPID=%lu", static_cast<unsigned long>(getpid()));
+            else
+                sd_notify(0, "READY=1");
+        }
+
+        long drainTimeout = conf.GetInteger("smtp-js-http", "drain-timeout", DEFAULT_DRAIN_TIMEOUT);
+
+        std::string mpath = conf.Get("smtp-js-http", "metrics-file", "");
+        std::chrono::steady_clock::time_point metricsDue;
 
         g_Running.store(true);
+        g_Processing.store(true);
+
+        if (pjournal)
+            pjournal->Start();
 
-        // start the script thread
-        std::thread worker(ThreadProc, scriptPath, std::ref(mailqueue));
+        // start the script threads
+        spdlog::info("Starting {} worker(s)", workers);
+        std::vector<std::thread> pool;
+        for (long i = 0; i < workers; ++i)
+            pool.push_back(std::thread(ThreadProc, scriptPath, std::ref(mailqueue), std::ref(replies),
+                std::ref(backlog), pjournal, std::cref(routes), std::ref(expiry),
+                std::ref(dedup), scripts));
+
+        // the predecessor can let go now
+        if (upgraded)
+            handoff.Ready();
 
         // main loop
         while (g_Running)
@@ -213,20 +724,99 @@ int main(int argc, char **argv)
             if (!smtp.Update())
                 g_Running.store(false);
 
+            if (!mpath.empty() && std::chrono::steady_clock::now() >= metricsDue)
+            {
+                Metrics::Write(mpath);
+                metricsDue = std::chrono::steady_clock::now() + METRICS_INTERVAL;
+            }
+
             if (daemon)
                 sd_notify(0, "WATCHDOG=1");
             
             std::this_thread::yield();
         }
 
+        // once handed off, the successor is the one systemd is tracking
+        if (handedOff)
+            daemon = false;
+
         if (daemon)
             sd_notify(0, "STOPPING=1");
 
         spdlog::info("Stopping smtp-js-http service");
 
+        // let the open sessions and the worker finish what they have, up to
+        // the drain timeout
+        smtp.Drain();
+
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+            std::chrono::seconds(drainTimeout);
+        std::chrono::steady_clock::time_point report;
+
+        while (true)
+        {
+            size_t sessions = smtp.Sessions();
+            size_t queued = mailqueue.Queued();
+            if (sessions == 0 && queued == 0 && mailqueue.Active() == 0)
+                break;
+
+            // nothing more can join a digest still being collected
+            if (sessions == 0)
+                mailqueue.Flush();
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                spdlog::warn("Drain timed out with {} session(s) open and {} message(s) queued",
+                    sessions, queued);
+                break;
+            }
+
+            if (now >= report)
+            {
+                spdlog::info("Draining: {} session(s) open, {} message(s) queued", sessions, queued);
+                if (daemon)
+                    sd_notifyf(0, "STATUS=Draining: %zu session(s) open, %zu message(s) queued",
+                        sessions, queued);
+
+                report = now + std::chrono::seconds(1);
+            }
+
+            if (!smtp.Update())
+                break;
+
+            if (daemon)
+                sd_notify(0, "WATCHDOG=1");
+        }
+
         smtp.Stop();
-        worker.join();
 
+        g_Processing.store(false);
+        for (std::vector<std::thread>::iterator i = pool.begin(); i != pool.end(); ++i)
+            i->join();
+
+        size_t remaining = mailqueue.Queued();
+        if (remaining > 0)
+        {
+            if (pjournal)
+                spdlog::info("{} unprocessed message(s) left in the journal for the next start", remaining);
+            else
+                spdlog::warn("{} unprocessed message(s) dropped, the journal is disabled", remaining);
+        }
+
+        if (pjournal)
+            pjournal->Stop();
+
+        if (pretries)
+            pretries->Stop();
+
+        if (!mpath.empty())
+            Metrics::Write(mpath);
+
+        // only now can a successor safely take over our journal
+        handoff.Close();
+
+        WebRequest::Cleanup();
         curl_global_cleanup();
     }
     catch (std::exception &e)
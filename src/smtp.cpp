@@ -22,14 +22,33 @@
 
 #include "spdlog/spdlog.h"
 
+#include "journal.hpp"
+#include "metrics.hpp"
+#include "scheduler.hpp"
 #include "smtp.hpp"
+#include "smtpcommand.hpp"
 
 #include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sstream>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
+#define SMTP_CLOSING    "421 smtp-js-http Service not available, closing transmission channel"
+#define SMTP_BUSY       "421 smtp-js-http Service not available, too much mail queued"
+
+#define METRIC_REJECTED         "smtp_js_http_rejected_total"
+#define METRIC_REJECTED_HELP    "Connections and transactions turned away while the backlog was throttled"
+
+// while draining, idle sessions are closed once they've been quiet this long
+#define DRAIN_IDLE_GRACE    std::chrono::seconds(1)
+
+// spooled messages are written in chunks of at least this size
+#define SPOOL_WRITE_SIZE    (64 * 1024)
+
 void* get_in_addr(struct sockaddr *sa)
 {
     if (sa->sa_family == AF_INET)
@@ -40,25 +59,25 @@ void* get_in_addr(struct sockaddr *sa)
 
 int sendLine(int sock, const std::string &line)
 {
-    int total = 0;
-    int bytesLeft = line.length() + 1;
-    int n;
-
     std::string _line(line);
     _line.append("\r\n");
     const char *buf = _line.c_str();
 
-    while (total < line.length() + 1)
+    size_t total = 0;
+    size_t bytesLeft = _line.length();
+
+    while (bytesLeft > 0)
     {
-        int n = send(sock, buf + total, bytesLeft, 0);
+        ssize_t n = send(sock, buf + total, bytesLeft, MSG_NOSIGNAL);
         if (n == -1)
-            break;
+            return -1;
 
         total += n;
         bytesLeft -= n;
     }
 
-    return (n == -1 ? -1 : (total - 1));
+    // report the length of the line itself, excluding the CRLF
+    return static_cast<int>(total - 2);
 }
 
 int readLine(int sock, std::string &line)
@@ -84,30 +103,298 @@ class SMTPConn
 {
 private:
     int m_Socket;
-    moodycamel::ConcurrentQueue<email> &m_Queue;
+    Scheduler &m_Queue;
+    const SMTPOptions &m_Options;
+    Backlog &m_Backlog;
+    const RouteTable &m_Routes;
+    Journal *m_Journal;
 
     enum State
     {
         STATE_CONNECTION,
-        STATE_EHLO,
         STATE_COMMANDS,
-        STATE_DATA,
-        STATE_DATAEOM,
+        STATE_DATA,         // reading the header block
+        STATE_DATABODY,     // reading the content
+        STATE_PENDING,      // waiting for the journal or the script before replying
     };
 
     State m_State;
 
     std::string m_Client;
+    std::string m_Line;
+    SMTPCommand m_Command;
+    bool m_HasSender;
 
     email m_Mail;
 
+    std::chrono::steady_clock::time_point m_LastActive;
+
+    // large messages are streamed to disk, m_Mail.data is then only a
+    // write buffer in front of the file
+    SpoolWriter m_Spool;
+    bool m_SpoolFailed;
+
+    bool Reply(const std::string &line)
+    {
+        return (sendLine(m_Socket, line) == static_cast<int>(line.length()));
+    }
+
+    void ResetTransaction(void)
+    {
+        m_HasSender = false;
+
+        m_Mail.from.clear();
+        m_Mail.to.clear();
+        m_Mail.date.clear();
+        m_Mail.subject.clear();
+        m_Mail.headers.clear();
+        m_Mail.data.clear();
+        m_Mail.bodyOffset = 0;
+        m_Mail.spoolFile.clear();
+
+        m_Spool.Discard();
+        m_SpoolFailed = false;
+    }
+
+    // bytes of message data received so far
+    size_t Received(void) const
+    {
+        return m_Spool.Size() + m_Mail.data.length();
+    }
+
+    void Spool(bool force)
+    {
+        if (m_SpoolFailed)
+        {
+            m_Mail.data.clear();    // keep reading, but don't grow
+            return;
+        }
+
+        if (!m_Spool.IsOpen())
+        {
+            if (m_Options.spoolThreshold == 0 || m_Mail.data.length() <= m_Options.spoolThreshold)
+                return;
+
+            if (!m_Spool.Open(m_Options.spoolPath))
+            {
+                m_SpoolFailed = true;
+                m_Mail.data.clear();
+                return;
+            }
+
+            spdlog::debug("SMTP server: client {} message spooled to {}", m_Socket, m_Spool.Path().c_str());
+        }
+        else if (!force && m_Mail.data.length() < SPOOL_WRITE_SIZE)
+            return;     // batch up small lines into larger writes
+
+        if (!m_Spool.Write(m_Mail.data.data(), m_Mail.data.length()))
+            m_SpoolFailed = true;
+
+        m_Mail.data.clear();
+    }
+
+    void FinishData(void)
+    {
+        if (m_State == STATE_DATA)
+            m_Mail.bodyOffset = Received();     // headers only
+
+        if (m_Spool.IsOpen())
+        {
+            Spool(true);
+            if (!m_SpoolFailed && !m_Spool.Close())
+                m_SpoolFailed = true;
+        }
+
+        if (m_SpoolFailed)
+        {
+            spdlog::warn("SMTP server: unable to spool mail from client {}", m_Socket);
+            if (Reply("452 Insufficient system storage"))
+                m_State = STATE_COMMANDS;
+
+            ResetTransaction();
+            return;
+        }
+
+        m_Mail.spoolFile = m_Spool.Release();
+        m_Mail.received = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+        const std::string *header = FindHeader(m_Mail.headers, "Date");
+        if (header)
+            m_Mail.date.assign(*header);
+
+        header = FindHeader(m_Mail.headers, "Subject");
+        if (header)
+            m_Mail.subject.assign(*header);
+
+        // the strictest mode of all the recipients' routes applies
+        AckMode ack = ACK_QUEUED;
+        for (std::vector<std::string>::iterator i = m_Mail.to.begin(); i != m_Mail.to.end(); ++i)
+        {
+            const Route &route = m_Routes.ForRecipient((*i));
+            if (route.ackMode > ack)
+                ack = route.ackMode;
+        }
+
+        if (ack == ACK_DURABLE && !m_Journal)
+            ack = ACK_QUEUED;
+
+        if (ack == ACK_PROCESSED)
+            m_Mail.replyToken = m_Socket;
+
+        if (ack == ACK_QUEUED)
+        {
+            if (Reply("250 OK"))
+                m_State = STATE_COMMANDS;
+        }
+        else
+            m_State = STATE_PENDING;    // the reply is sent from Complete()
+
+        m_Backlog.Add(m_Mail.data.length());
+
+        if (m_Journal)
+        {
+            // the journal queues the message once it's on disk
+            spdlog::debug("SMTP server: Journalling mail from client {}", m_Socket);
+            m_Journal->Append(m_Mail, (ack == ACK_DURABLE ? m_Socket : -1));
+        }
+        else
+        {
+            spdlog::debug("SMTP server: Enqueuing mail from client {}", m_Socket);
+
+            // queue the message
+            m_Queue.Enqueue(m_Mail);
+        }
+
+        // clear up the mail packet
+        ResetTransaction();
+    }
+
+    int HandleCommand(void)
+    {
+        SMTPParseResult parse = ParseCommand(m_Line.data(), m_Line.length(), m_Command);
+        if (parse == PARSE_UNKNOWN)
+        {
+            spdlog::debug("SMTP server: client {} sent unknown command", m_Socket);
+            return (Reply("500 Command not recognized") ? 1 : -1);
+        }
+        else if (parse == PARSE_SYNTAX)
+        {
+            spdlog::debug("SMTP server: client {} sent malformed command", m_Socket);
+            return (Reply("501 Syntax error in parameters or arguments") ? 1 : -1);
+        }
+
+        bool sent = false;
+        switch (m_Command.verb)
+        {
+            case VERB_HELO:
+            case VERB_EHLO:
+            {
+                ResetTransaction();
+
+                m_Client.assign(m_Command.arg.ptr, m_Command.arg.len);
+                spdlog::debug("SMTP server client {} name is {}", m_Socket, m_Client.c_str());
+
+                std::ostringstream oss;
+                if (m_Command.verb == VERB_EHLO)
+                {
+                    oss << "250-smtp-js-http greets " << m_Client;
+                    sent = Reply(oss.str()) && Reply("250 8BITMIME");
+                }
+                else
+                {
+                    oss << "250 smtp-js-http greets " << m_Client;
+                    sent = Reply(oss.str());
+                }
+            } break;
+
+            case VERB_MAIL:
+            {
+                if (m_Client.empty())
+                    sent = Reply("503 Send HELO or EHLO first");
+                else if (m_HasSender)
+                    sent = Reply("503 Sender already specified");
+                else if (m_Backlog.IsThrottled())
+                {
+                    Metrics::Counter(METRIC_REJECTED "{reason=\"transaction\"}", METRIC_REJECTED_HELP)++;
+                    sent = Reply("451 Requested action aborted: too much mail queued, try again later");
+                }
+                else
+                {
+                    m_HasSender = true;
+                    m_Mail.from.assign(m_Command.path.ptr, m_Command.path.len);
+                    spdlog::debug("SMTP server: client {} sending email from {}", m_Socket, m_Mail.from.c_str());
+
+                    sent = Reply("250 OK");
+                }
+            } break;
+
+            case VERB_RCPT:
+            {
+                if (!m_HasSender)
+                    sent = Reply("503 Need MAIL before RCPT");
+                else
+                {
+                    m_Mail.to.push_back(m_Command.path.str());
+                    spdlog::debug("SMTP server: client {} sending email to {}", m_Socket, m_Mail.to.back().c_str());
+
+                    sent = Reply("250 OK");
+                }
+            } break;
+
+            case VERB_DATA:
+            {
+                if (m_Mail.to.empty())
+                    sent = Reply("503 Need RCPT before DATA");
+                else
+                {
+                    sent = Reply("354 Start mail input; end with <CRLF>.<CRLF>");
+                    if (sent)
+                        m_State = STATE_DATA;
+                }
+            } break;
+
+            case VERB_RSET:
+            {
+                ResetTransaction();
+                sent = Reply("250 OK");
+            } break;
+
+            case VERB_NOOP:
+                sent = Reply("250 OK");
+                break;
+
+            case VERB_VRFY:
+                sent = Reply("252 Cannot VRFY user, but will accept message and attempt delivery");
+                break;
+
+            case VERB_HELP:
+                sent = Reply("214 See RFC 5321");
+                break;
+
+            case VERB_QUIT:
+                return 0;
+
+            default:
+                sent = Reply("500 Command not recognized");
+                break;
+        }
+
+        return (sent ? 1 : -1);
+    }
+
 public:
-    SMTPConn(int sock, moodycamel::ConcurrentQueue<email> &queue)
-        : m_Socket(sock), m_Queue(queue)
+    SMTPConn(int sock, Scheduler &queue, const SMTPOptions &options,
+        Backlog &backlog, const RouteTable &routes, Journal *journal)
+        : m_Socket(sock), m_Queue(queue), m_Options(options), m_Backlog(backlog), m_Routes(routes),
+        m_Journal(journal)
     {
         spdlog::debug("Creating new SMTP connection for socket {}", m_Socket);
 
         m_State = STATE_CONNECTION;
+        m_HasSender = false;
+        m_SpoolFailed = false;
+        m_LastActive = std::chrono::steady_clock::now();
     }
 
     ~SMTPConn(void)
@@ -115,9 +402,40 @@ public:
         spdlog::debug("Destroying SMTP connection for socket {}", m_Socket);
     }
 
+    // nothing is read from the client while the reply to DATA is held back
+    bool IsWaiting(void) const { return m_State == STATE_PENDING; }
+
+    // not in the middle of a mail transaction or waiting for its reply
+    bool IsIdle(void) const { return m_State == STATE_COMMANDS && !m_HasSender; }
+
+    // has been given a sender and will be adding a message to the backlog
+    bool InTransaction(void) const { return m_HasSender; }
+
+    // a draining session is closed once it's idle and the client has gone
+    // quiet, so one that is about to send another message gets to send it
+    bool IsDrained(std::chrono::steady_clock::time_point now) const
+    {
+        return IsIdle() && now - m_LastActive >= DRAIN_IDLE_GRACE;
+    }
+
+    // the message sent by this client was journalled or processed
+    int Complete(bool ok)
+    {
+        if (m_State != STATE_PENDING)
+            return 1;
+
+        m_State = STATE_COMMANDS;
+        if (ok)
+            return (Reply("250 OK") ? 1 : -1);
+
+        spdlog::warn("SMTP server: mail from client {} was not accepted", m_Socket);
+        return (Reply("451 Requested action aborted: local error in processing") ? 1 : -1);
+    }
+
     int Update(void)
     {
         int result = -1;
+        m_LastActive = std::chrono::steady_clock::now();
 
         switch (m_State)
         {
@@ -129,139 +447,63 @@ public:
 
                 result = sendLine(m_Socket, oss.str());
                 if (result == oss.str().length())
-                    m_State = STATE_EHLO;
+                    m_State = STATE_COMMANDS;
                 else
                     spdlog::warn("SMTP server: failed to send greeting to client {}", m_Socket);
             } break;
 
-            case STATE_EHLO:
-            {
-                std::string ehlo;
-                result = readLine(m_Socket, ehlo);
-                if (result > 0) 
-                {
-                    // check if the client sent a EHLO
-                    if (ehlo.find("EHLO") != std::string::npos ||
-                        ehlo.find("HELO") != std::string::npos)
-                    {
-                        m_Client = ehlo.substr(5);
-                        spdlog::debug("SMTP server client {} name is {}", m_Socket, m_Client.c_str());
-
-                        // currently we don't support any options
-                        std::ostringstream oss;
-                        oss << "250 smtp-js-http greets " << m_Client;
-                        result = sendLine(m_Socket, oss.str());
-                        if (result == oss.str().length())
-                            m_State = STATE_COMMANDS;
-                        else
-                        {
-                            spdlog::warn("SMTP server: failed to send options to client {}", m_Socket);
-                            result = 0;
-                        }
-                    }
-                    else
-                        spdlog::debug("SMTP server: client {} didn't send EHLO or HELO", m_Socket);
-                }
-            } break;
-
             case STATE_COMMANDS:
             {
-                std::string line;
-                result = readLine(m_Socket, line);
+                m_Line.clear();
+                result = readLine(m_Socket, m_Line);
                 if (result > 0)
-                {
-                    if (line.find("MAIL FROM:") != std::string::npos)
-                    {
-                        m_Mail.from.assign(line.substr(11, line.length() - 12));
-                        spdlog::debug("SMTP server: client {} sending email from {}", m_Socket, m_Mail.from.c_str());
-                    }
-                    else if (line.find("RCPT TO:") != std::string::npos)
-                    {
-                        std::string to(line.substr(9, line.length() - 10));
-                        m_Mail.to.push_back(to);
-                        spdlog::debug("SMTP server: client {} sending email to {}", m_Socket, to.c_str());
-                    }
-                    else if (line.find("DATA") != std::string::npos)
-                    {
-                        std::string cmd("354 Start mail input; end with <CRLF>.<CRLF>");
-                        if (sendLine(m_Socket, cmd) == cmd.length())
-                            m_State = STATE_DATA;                        
-                    }
-                    else if (line.compare("QUIT") == 0)
-                        result = 0;
-                }
+                    result = HandleCommand();
             } break;
 
             case STATE_DATA:
+            case STATE_DATABODY:
             {
-                std::string line;
-                result = readLine(m_Socket, line);
+                m_Line.clear();
+                result = readLine(m_Socket, m_Line);
                 if (result > 0)
                 {
-                    if (line.empty() || line.compare("\\r\\n") == 0)
-                        m_State = STATE_DATAEOM;
-                    else
+                    if (m_Line.compare(".") == 0)
                     {
-                        spdlog::debug("Processing line from client {}: {}", m_Socket, line.c_str());
-
-                        // process the line
-                        if (line.find("Date:") == 0)
-                            m_Mail.date.assign(line.substr(6));
-                        else if (line.find("Subject:") == 0)
-                            m_Mail.subject.assign(line.substr(9));
-                        else if (line.find("From:") == 0)
-                            ;   // we don't care
-                        else if (line.find("To:") == 0)
-                            ; // we don't care
-                        else
-                        {
-                            if (m_Mail.body.empty())
-                                m_Mail.body.assign(line);
-                            else
-                                m_Mail.body.append(line);
-
-                            // if (line.length() > 0)
-                            //     m_Mail.body.append("\r\n");
-                        }
+                        FinishData();
+                        break;
                     }
-                }
-            } break;
-
-            case STATE_DATAEOM:
-            {
-                std::string line;
-                result = readLine(m_Socket, line);
-                if (result > 0)
-                {
-                    spdlog::debug("Processing line for EOM: {}", line.c_str());
 
-                    if (line.compare(".") == 0)
-                    {
-                        if (sendLine(m_Socket, "250 OK") == 6)
-                            m_State = STATE_COMMANDS;
-
-                        spdlog::debug("SMTP server: Enqueuing mail from client {}", m_Socket);
+                    // undo the transparency dot-stuffing of RFC 5321 4.5.2
+                    std::string::size_type start = (m_Line.compare(0, 2, "..") == 0 ? 1 : 0);
 
-                        // queue the message
-                        m_Queue.enqueue(m_Mail);
-
-                        // clear up the mail packet
-                        m_Mail.from.clear();
-                        m_Mail.to.clear();
-                        m_Mail.date.clear();
-                        m_Mail.subject.clear();
-                        m_Mail.body.clear();
-                    }
-                    else
+                    if (m_State == STATE_DATA)
                     {
-                        m_Mail.body.append(line);
-                        m_Mail.body.append("\r\n");
-                        m_State = STATE_DATA;
+                        if (m_Line.empty())
+                        {
+                            // end of the header block
+                            m_State = STATE_DATABODY;
+                            m_Mail.data.append("\r\n");
+                            m_Mail.bodyOffset = Received();
+                            break;
+                        }
+                        else if (!AddHeaderLine(m_Mail.headers, m_Line.substr(start)))
+                        {
+                            // not a header, treat everything from here on as content
+                            m_State = STATE_DATABODY;
+                            m_Mail.bodyOffset = Received();
+                        }
                     }
-                }
 
+                    m_Mail.data.append(m_Line, start, std::string::npos);
+                    m_Mail.data.append("\r\n");
+                    Spool(false);
+                }
             } break;
 
+            case STATE_PENDING:
+                result = 1;     // the reply is pending, leave the input alone
+                break;
+
             default: break;
         }
 
@@ -269,12 +511,51 @@ public:
     }
 };
 
-SMTPServer::SMTPServer(moodycamel::ConcurrentQueue<email> &queue)
-    : m_Queue(queue)
+ReplyQueue::ReplyQueue(void)
+{
+    m_EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_EventFd == -1)
+        throw std::runtime_error("Unable to create reply queue event");
+}
+
+ReplyQueue::~ReplyQueue(void)
+{
+    close(m_EventFd);
+}
+
+void ReplyQueue::Post(int token, bool ok)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Replies.push_back(std::make_pair(token, ok));
+    }
+
+    uint64_t one = 1;
+    if (write(m_EventFd, &one, sizeof(one)) < 0)
+        spdlog::error("SMTP server: unable to signal reply for client {}", token);
+}
+
+void ReplyQueue::Collect(std::vector<std::pair<int, bool>> &replies)
+{
+    uint64_t count;
+    if (read(m_EventFd, &count, sizeof(count)) < 0)
+        ; // nothing signalled, or already drained
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    replies.swap(m_Replies);
+    m_Replies.clear();
+}
+
+SMTPServer::SMTPServer(Scheduler &queue, const SMTPOptions &options,
+    ReplyQueue &replies, Backlog &backlog, const RouteTable &routes, Journal *journal)
+    : m_Queue(queue), m_Options(options), m_Replies(replies), m_Backlog(backlog), m_Routes(routes),
+    m_Journal(journal)
 {
     m_Listener = -1;
     FD_ZERO(&m_Master);
     m_FdMax = 0;
+    m_Draining = false;
+    m_Throttled = false;
 }
 
 SMTPServer::~SMTPServer(void)
@@ -330,31 +611,146 @@ bool SMTPServer::Start(const std::string &addr, const std::string &port)
         return false;
     }
 
-    FD_SET(m_Listener, &m_Master);
-    m_FdMax = m_Listener;
-
     spdlog::info("SMTP server started on {}:{}",
         addr.c_str(), port.c_str());
+    return Adopt(m_Listener);
+}
+
+bool SMTPServer::Adopt(int listener)
+{
+    m_Listener = listener;
+
+    FD_SET(m_Listener, &m_Master);
+    if (m_Listener > m_FdMax)
+        m_FdMax = m_Listener;
+
+    FD_SET(m_Replies.EventFd(), &m_Master);
+    if (m_Replies.EventFd() > m_FdMax)
+        m_FdMax = m_Replies.EventFd();
+
     return true;
 }
 
+void SMTPServer::Watch(int fd, const std::function<void(void)> &callback)
+{
+    m_Watches[fd] = callback;
+
+    FD_SET(fd, &m_Master);
+    if (fd > m_FdMax)
+        m_FdMax = fd;
+}
+
+void SMTPServer::Unwatch(int fd)
+{
+    m_Watches.erase(fd);
+    FD_CLR(fd, &m_Master);
+}
+
 void SMTPServer::Stop(void)
 {
+    while (!m_Connections.empty())
+        Close(m_Connections.begin(), SMTP_CLOSING);
+
+    if (m_Listener != -1)
+        close(m_Listener);
+    m_Listener = -1;
+
+    FD_CLR(m_Replies.EventFd(), &m_Master);
+    for (std::map<int, std::function<void(void)>>::iterator i = m_Watches.begin(); i != m_Watches.end(); ++i)
+        FD_CLR(i->first, &m_Master);
+    m_Watches.clear();
+    m_FdMax = -1;
+}
+
+void SMTPServer::Drain(void)
+{
+    if (m_Draining)
+        return;
+
+    spdlog::info("SMTP server: no longer accepting connections, {} session(s) open",
+        m_Connections.size());
+
+    m_Draining = true;
+
+    FD_CLR(m_Listener, &m_Master);
+    close(m_Listener);
+    m_Listener = -1;
+
+    CloseIdle();
+}
+
+void SMTPServer::Close(std::map<int, SMTPConn*>::iterator conn, const char *reply)
+{
+    if (reply)
+        sendLine(conn->first, reply);
+
+    spdlog::info("SMTP server: closing connection to client {}", conn->first);
+    close(conn->first);
+    FD_CLR(conn->first, &m_Master);
+
+    delete conn->second;
+    m_Connections.erase(conn);
+}
+
+void SMTPServer::CloseIdle(void)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    std::map<int, SMTPConn*>::iterator conn = m_Connections.begin();
+    while (conn != m_Connections.end())
+    {
+        std::map<int, SMTPConn*>::iterator next = conn;
+        ++next;
+
+        if (conn->second->IsDrained(now))
+            Close(conn, SMTP_CLOSING);
+
+        conn = next;
+    }
+}
+
+void SMTPServer::Throttle(bool throttled)
+{
+    m_Throttled = throttled;
+
+    // sessions part way through a transaction are simply not read from, so
+    // TCP holds their clients back until there is room again
     for (std::map<int, SMTPConn*>::iterator conn = m_Connections.begin();
         conn != m_Connections.end(); ++conn)
     {
-        delete conn->second;
-        close(conn->first);
-        FD_CLR(conn->first, &m_Master);
+        if (conn->second->IsWaiting())
+            continue;
+
+        if (!throttled)
+            FD_SET(conn->first, &m_Master);
+        else if (conn->second->InTransaction())
+            FD_CLR(conn->first, &m_Master);
     }
-    m_Connections.clear();
+}
 
-    close(m_Listener);
-    m_FdMax = -1;
+void SMTPServer::HandleReplies(void)
+{
+    std::vector<std::pair<int, bool>> replies;
+    m_Replies.Collect(replies);
+
+    for (std::vector<std::pair<int, bool>>::iterator i = replies.begin(); i != replies.end(); ++i)
+    {
+        std::map<int, SMTPConn*>::iterator conn = m_Connections.find(i->first);
+        if (conn == m_Connections.end() || !conn->second->IsWaiting())
+            continue;
+
+        if (conn->second->Complete(i->second) > 0)
+            FD_SET(conn->first, &m_Master);     // resume reading commands
+        else
+            Close(conn, nullptr);
+    }
 }
 
 bool SMTPServer::Update(void)
 {
+    if (m_Backlog.IsThrottled() != m_Throttled)
+        Throttle(!m_Throttled);
+
     fd_set read_fds = m_Master;
     struct timeval tv;
     tv.tv_sec = 0;
@@ -364,7 +760,9 @@ bool SMTPServer::Update(void)
         return false;   // we are stopped
 
     int retval = select(m_FdMax + 1, &read_fds, nullptr, nullptr, &tv);
-    if (m_FdMax > 0 && retval == -1)
+    if (retval == -1 && errno == EINTR)
+        return true;    // a signal, e.g. the one asking us to stop
+    else if (m_FdMax > 0 && retval == -1)
     {
         spdlog::error("SMTP server update failed: Unable to check sockets");
         return false;
@@ -375,7 +773,16 @@ bool SMTPServer::Update(void)
         {
             if (FD_ISSET(i, &read_fds))
             {
-                if (i == m_Listener)    // new connection
+                std::map<int, std::function<void(void)>>::iterator watch = m_Watches.find(i);
+                if (watch != m_Watches.end())
+                {
+                    // the callback may unwatch itself
+                    std::function<void(void)> callback = watch->second;
+                    callback();
+                }
+                else if (i == m_Replies.EventFd())
+                    HandleReplies();
+                else if (i == m_Listener)    // new connection
                 {
                     struct sockaddr_storage remoteaddr;
                     socklen_t addrlen = sizeof(remoteaddr);
@@ -387,13 +794,20 @@ bool SMTPServer::Update(void)
 
                     if (newfd == -1)
                         spdlog::warn("SMTP server update failed: Unable to accept new connection");
+                    else if (m_Throttled)
+                    {
+                        // shed load rather than take on sessions we can't serve
+                        Metrics::Counter(METRIC_REJECTED "{reason=\"connection\"}", METRIC_REJECTED_HELP)++;
+                        sendLine(newfd, SMTP_BUSY);
+                        close(newfd);
+                    }
                     else
                     {
                         spdlog::info("SMTP server: client {} connected from {}", newfd,
                             inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr*)&remoteaddr),
                                 remoteIP, INET6_ADDRSTRLEN));
 
-                        SMTPConn *conn = new SMTPConn(newfd, m_Queue);
+                        SMTPConn *conn = new SMTPConn(newfd, m_Queue, m_Options, m_Backlog, m_Routes, m_Journal);
                         if (conn == nullptr)
                             spdlog::error("SMTP server failed to create connection");
                         else
@@ -432,6 +846,8 @@ bool SMTPServer::Update(void)
                             delete conn->second;
                             m_Connections.erase(conn);
                         }
+                        else if (conn->second->IsWaiting())
+                            FD_CLR(conn->first, &m_Master);
                     }
                     else
                     {
@@ -444,5 +860,9 @@ bool SMTPServer::Update(void)
         }
     }
 
+    // sessions that have just had their last message answered
+    if (m_Draining)
+        CloseIdle();
+
     return true;
 }
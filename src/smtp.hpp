@@ -22,23 +22,56 @@
 
 #pragma once
 
-#include "concurrentqueue.h"
+#include "backlog.hpp"
+#include "mime.hpp"
+#include "routes.hpp"
+#include "spool.hpp"
 
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sys/types.h>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
+struct DigestInfo;
+
 struct email
 {
     std::string from;
     std::vector<std::string> to;
     std::string date;
     std::string subject;
-    std::string body;
+    MimeHeaders headers;
+
+    // the message as received (headers and content), and where the
+    // content starts within it
+    std::string data;
+    size_t bodyOffset;
+
+    // large messages are kept in the spool instead of 'data'. the worker
+    // maps the file while it processes the message
+    std::string spoolFile;
+    std::shared_ptr<MappedFile> mapped;
+
+    // journal sequence number, 0 if the message isn't journalled
+    uint64_t id;
+
+    // the session waiting for the result of the script, -1 if none
+    int replyToken;
+
+    // when the message was accepted, in milliseconds since the epoch. 0 if
+    // unknown, e.g. for messages journalled by an older version
+    int64_t received;
+
+    // set when this email stands for several, see Digest
+    std::shared_ptr<const DigestInfo> digest;
 
-    email(void) {}
+    email(void) : bodyOffset(0), id(0), replyToken(-1), received(0) {}
     email(const email &that)
     {
         from = that.from;
@@ -47,28 +80,106 @@ struct email
             to.push_back((*i));
         date = that.date;
         subject = that.subject;
-        body = that.body;
+        headers = that.headers;
+        data = that.data;
+        bodyOffset = that.bodyOffset;
+        spoolFile = that.spoolFile;
+        mapped = that.mapped;
+        id = that.id;
+        replyToken = that.replyToken;
+        received = that.received;
+        digest = that.digest;
     }
+
+    const char* Data(void) const { return (mapped ? mapped->Data() : data.data()); }
+    char* Data(void) { return (mapped ? mapped->Data() : &data[0]); }
+    size_t DataLength(void) const { return (mapped ? mapped->Length() : data.length()); }
+
+    const char* Body(void) const { return Data() + bodyOffset; }
+    char* Body(void) { return Data() + bodyOffset; }
+    size_t BodyLength(void) const { return DataLength() - bodyOffset; }
+};
+
+struct SMTPOptions
+{
+    std::string spoolPath;
+    size_t spoolThreshold;      // larger messages go to the spool, 0 disables
+
+    SMTPOptions(void) : spoolThreshold(0) {}
+};
+
+// Outcomes for sessions whose reply to DATA is held back, posted by the
+// journal and worker threads. EventFd() becomes readable when there is
+// something to collect, so the select loop never has to block on them.
+class ReplyQueue
+{
+private:
+    std::mutex m_Mutex;
+    std::vector<std::pair<int, bool>> m_Replies;
+    int m_EventFd;
+
+public:
+    ReplyQueue(void);
+    virtual ~ReplyQueue(void);
+
+    int EventFd(void) const { return m_EventFd; }
+
+    void Post(int token, bool ok);
+    void Collect(std::vector<std::pair<int, bool>> &replies);
 };
 
+class Journal;
+class Scheduler;
 class SMTPConn;
 
 class SMTPServer
 {
 private:
-    moodycamel::ConcurrentQueue<email> &m_Queue;
+    Scheduler &m_Queue;
+    SMTPOptions m_Options;
+    ReplyQueue &m_Replies;
+    Backlog &m_Backlog;
+    const RouteTable &m_Routes;
+    Journal *m_Journal;
     std::map<int, SMTPConn*> m_Connections;
 
     int m_Listener;
     fd_set m_Master;
     int m_FdMax;
 
+    bool m_Draining;
+    bool m_Throttled;           // following the backlog, see Throttle()
+
+    // other descriptors served by the select loop
+    std::map<int, std::function<void(void)>> m_Watches;
+
 public:
-    SMTPServer(moodycamel::ConcurrentQueue<email> &queue);
+    // without a journal, durable acknowledgement falls back to queued
+    SMTPServer(Scheduler &queue, const SMTPOptions &options,
+        ReplyQueue &replies, Backlog &backlog, const RouteTable &routes, Journal *journal = nullptr);
     virtual ~SMTPServer(void);
 
     bool Start(const std::string &addr, const std::string &port);
+    // start on a socket that is already listening, e.g. from systemd
+    bool Adopt(int listener);
     void Stop(void);
 
+    int Listener(void) const { return m_Listener; }
+
+    // calls 'callback' from Update() whenever 'fd' is readable
+    void Watch(int fd, const std::function<void(void)> &callback);
+    void Unwatch(int fd);
+
+    // stop accepting connections. sessions are closed with 421 once their
+    // current message has been answered, or when they go quiet
+    void Drain(void);
+    size_t Sessions(void) const { return m_Connections.size(); }
+
     bool Update(void);
+
+private:
+    void HandleReplies(void);
+    void Throttle(bool throttled);
+    void Close(std::map<int, SMTPConn*>::iterator conn, const char *reply);
+    void CloseIdle(void);
 };
@@ -0,0 +1,259 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "smtpcommand.hpp"
+
+// Verbs are all four letters, so they are packed into a 32 bit word with the
+// ASCII case bit forced on. Only letters fold onto 'a'..'z' this way, so a
+// plain comparison against the lower case key is an exact case-insensitive
+// match.
+static constexpr uint32_t Pack(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    return ((uint32_t(a) << 24) | (uint32_t(b) << 16) |
+        (uint32_t(c) << 8) | uint32_t(d)) | 0x20202020u;
+}
+
+static constexpr uint32_t Pack(const char *s)
+{
+    return Pack(s[0], s[1], s[2], s[3]);
+}
+
+// multiplicative hash into 16 slots. the multiplier was chosen so that every
+// verb lands in its own slot, which the static_asserts below verify
+#define VERB_HASH_MULT  0x85EBCA6Bu
+#define VERB_HASH_BITS  4
+
+static constexpr uint32_t Slot(uint32_t word)
+{
+    return uint32_t(word * VERB_HASH_MULT) >> (32 - VERB_HASH_BITS);
+}
+
+struct VerbEntry
+{
+    uint32_t key;
+    SMTPVerb verb;
+};
+
+static const VerbEntry s_Verbs[1 << VERB_HASH_BITS] =
+{
+    { 0,            VERB_UNKNOWN }, // 0
+    { Pack("data"), VERB_DATA },    // 1
+    { Pack("quit"), VERB_QUIT },    // 2
+    { 0,            VERB_UNKNOWN }, // 3
+    { Pack("rset"), VERB_RSET },    // 4
+    { 0,            VERB_UNKNOWN }, // 5
+    { Pack("help"), VERB_HELP },    // 6
+    { Pack("mail"), VERB_MAIL },    // 7
+    { 0,            VERB_UNKNOWN }, // 8
+    { Pack("noop"), VERB_NOOP },    // 9
+    { 0,            VERB_UNKNOWN }, // 10
+    { Pack("vrfy"), VERB_VRFY },    // 11
+    { Pack("rcpt"), VERB_RCPT },    // 12
+    { Pack("helo"), VERB_HELO },    // 13
+    { 0,            VERB_UNKNOWN }, // 14
+    { Pack("ehlo"), VERB_EHLO },    // 15
+};
+
+static_assert(Slot(Pack("data")) == 1, "verb hash collision");
+static_assert(Slot(Pack("quit")) == 2, "verb hash collision");
+static_assert(Slot(Pack("rset")) == 4, "verb hash collision");
+static_assert(Slot(Pack("help")) == 6, "verb hash collision");
+static_assert(Slot(Pack("mail")) == 7, "verb hash collision");
+static_assert(Slot(Pack("noop")) == 9, "verb hash collision");
+static_assert(Slot(Pack("vrfy")) == 11, "verb hash collision");
+static_assert(Slot(Pack("rcpt")) == 12, "verb hash collision");
+static_assert(Slot(Pack("helo")) == 13, "verb hash collision");
+static_assert(Slot(Pack("ehlo")) == 15, "verb hash collision");
+
+static inline char Fold(char ch)
+{
+    return (ch >= 'A' && ch <= 'Z') ? (ch | 0x20) : ch;
+}
+
+bool SMTPToken::equals(const char *str) const
+{
+    size_t i = 0;
+    for (; i < len && str[i] != '\0'; ++i)
+    {
+        if (Fold(ptr[i]) != Fold(str[i]))
+            return false;
+    }
+
+    return (i == len && str[i] == '\0');
+}
+
+const SMTPToken* SMTPCommand::Param(const char *key) const
+{
+    for (size_t i = 0; i < paramCount; ++i)
+    {
+        if (params[i].key.equals(key))
+            return &params[i].value;
+    }
+
+    return nullptr;
+}
+
+static size_t SkipSpaces(const char *line, size_t pos, size_t len)
+{
+    while (pos < len && line[pos] == ' ')
+        ++pos;
+    return pos;
+}
+
+// match a case-insensitive keyword such as "FROM:" at 'pos'
+static bool MatchKeyword(const char *line, size_t pos, size_t len, const char *keyword)
+{
+    for (; *keyword != '\0'; ++keyword, ++pos)
+    {
+        if (pos >= len || Fold(line[pos]) != Fold(*keyword))
+            return false;
+    }
+
+    return true;
+}
+
+// parses "<path> [SP param[=value]]*" starting at 'pos'
+static SMTPParseResult ParsePath(const char *line, size_t pos, size_t len,
+    bool allowNull, SMTPCommand &cmd)
+{
+    // some clients put a space after the colon, tolerate it
+    pos = SkipSpaces(line, pos, len);
+    if (pos >= len)
+        return PARSE_SYNTAX;
+
+    if (line[pos] == '<')
+    {
+        size_t start = ++pos;
+        while (pos < len && line[pos] != '>')
+            ++pos;
+
+        if (pos >= len)
+            return PARSE_SYNTAX;    // unterminated
+
+        cmd.path.ptr = line + start;
+        cmd.path.len = pos - start;
+        ++pos;
+    }
+    else
+    {
+        // bare address, not strictly RFC 5321 but commonly sent
+        size_t start = pos;
+        while (pos < len && line[pos] != ' ')
+            ++pos;
+
+        cmd.path.ptr = line + start;
+        cmd.path.len = pos - start;
+    }
+
+    if (cmd.path.empty() && !allowNull)
+        return PARSE_SYNTAX;
+
+    // ESMTP parameters
+    while (true)
+    {
+        size_t start = SkipSpaces(line, pos, len);
+        if (start >= len)
+            break;
+
+        if (start == pos)
+            return PARSE_SYNTAX;    // parameters must be space separated
+
+        if (cmd.paramCount == SMTP_MAX_PARAMS)
+            return PARSE_SYNTAX;
+
+        SMTPParam &param = cmd.params[cmd.paramCount++];
+        pos = start;
+        while (pos < len && line[pos] != ' ' && line[pos] != '=')
+            ++pos;
+
+        param.key.ptr = line + start;
+        param.key.len = pos - start;
+        if (param.key.empty())
+            return PARSE_SYNTAX;
+
+        if (pos < len && line[pos] == '=')
+        {
+            start = ++pos;
+            while (pos < len && line[pos] != ' ')
+                ++pos;
+
+            param.value.ptr = line + start;
+            param.value.len = pos - start;
+        }
+    }
+
+    return PARSE_OK;
+}
+
+SMTPParseResult ParseCommand(const char *line, size_t len, SMTPCommand &cmd)
+{
+    cmd.verb = VERB_UNKNOWN;
+    cmd.arg = SMTPToken();
+    cmd.path = SMTPToken();
+    cmd.paramCount = 0;
+
+    if (len < 4 || (len > 4 && line[4] != ' '))
+        return PARSE_UNKNOWN;
+
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(line);
+    uint32_t word = Pack(u[0], u[1], u[2], u[3]);
+    const VerbEntry &entry = s_Verbs[Slot(word)];
+    if (entry.key != word)
+        return PARSE_UNKNOWN;
+
+    cmd.verb = entry.verb;
+
+    // the argument is everything after the verb, minus surrounding spaces
+    size_t pos = SkipSpaces(line, 4, len);
+    size_t end = len;
+    while (end > pos && line[end - 1] == ' ')
+        --end;
+
+    cmd.arg.ptr = line + pos;
+    cmd.arg.len = end - pos;
+
+    switch (cmd.verb)
+    {
+        case VERB_HELO:
+        case VERB_EHLO:
+        case VERB_VRFY:
+            return (cmd.arg.empty() ? PARSE_SYNTAX : PARSE_OK);
+
+        case VERB_MAIL:
+            if (!MatchKeyword(line, pos, end, "FROM:"))
+                return PARSE_SYNTAX;
+            return ParsePath(line, pos + 5, end, true, cmd);
+
+        case VERB_RCPT:
+            if (!MatchKeyword(line, pos, end, "TO:"))
+                return PARSE_SYNTAX;
+            return ParsePath(line, pos + 3, end, false, cmd);
+
+        case VERB_DATA:
+        case VERB_RSET:
+        case VERB_QUIT:
+            return (cmd.arg.empty() ? PARSE_OK : PARSE_SYNTAX);
+
+        default:
+            return PARSE_OK;    // NOOP and HELP ignore their argument
+    }
+}
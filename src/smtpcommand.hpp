@@ -0,0 +1,89 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define SMTP_MAX_PARAMS     8
+
+enum SMTPVerb
+{
+    VERB_UNKNOWN,
+    VERB_HELO,
+    VERB_EHLO,
+    VERB_MAIL,
+    VERB_RCPT,
+    VERB_DATA,
+    VERB_RSET,
+    VERB_NOOP,
+    VERB_VRFY,
+    VERB_QUIT,
+    VERB_HELP,
+};
+
+enum SMTPParseResult
+{
+    PARSE_OK,
+    PARSE_UNKNOWN,  // not a command we recognise
+    PARSE_SYNTAX,   // known command, malformed arguments
+};
+
+// a slice of the command line. never owns memory, the line it was parsed
+// from must outlive it
+struct SMTPToken
+{
+    const char *ptr;
+    size_t len;
+
+    SMTPToken(void) : ptr(nullptr), len(0) {}
+
+    bool empty(void) const { return len == 0; }
+    bool equals(const char *str) const;     // case-insensitive
+    std::string str(void) const { return std::string(ptr, len); }
+};
+
+// ESMTP parameter, e.g. SIZE=1024 or BODY=8BITMIME
+struct SMTPParam
+{
+    SMTPToken key;
+    SMTPToken value;
+};
+
+struct SMTPCommand
+{
+    SMTPVerb verb;
+
+    SMTPToken arg;      // everything after the verb (HELO domain, VRFY string)
+    SMTPToken path;     // MAIL/RCPT path, without the angle brackets
+
+    SMTPParam params[SMTP_MAX_PARAMS];
+    size_t paramCount;
+
+    const SMTPToken* Param(const char *key) const;
+};
+
+// Tokenise a single command line (without the trailing CRLF). The line is
+// scanned once and nothing is allocated; all tokens point into 'line'.
+SMTPParseResult ParseCommand(const char *line, size_t len, SMTPCommand &cmd);
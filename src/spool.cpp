@@ -0,0 +1,215 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "spool.hpp"
+#include "spdlog/spdlog.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#define SPOOL_PREFIX    "msg-"
+
+SpoolWriter::SpoolWriter(void)
+    : m_Fd(-1), m_Size(0)
+{
+}
+
+SpoolWriter::~SpoolWriter(void)
+{
+    if (m_Fd != -1)
+        Discard();
+}
+
+bool SpoolWriter::Open(const std::string &dir)
+{
+    std::string tmpl(dir);
+    tmpl.append("/" SPOOL_PREFIX "XXXXXX");
+
+    std::vector<char> path(tmpl.begin(), tmpl.end());
+    path.push_back('\0');
+
+    m_Fd = mkostemp(path.data(), O_CLOEXEC);
+    if (m_Fd == -1)
+    {
+        spdlog::error("Spool: unable to create file in {}: {}", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    m_Path.assign(path.data());
+    m_Size = 0;
+    return true;
+}
+
+bool SpoolWriter::Write(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(m_Fd, data, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            spdlog::error("Spool: write to {} failed: {}", m_Path.c_str(), strerror(errno));
+            return false;
+        }
+
+        data += n;
+        len -= n;
+        m_Size += n;
+    }
+
+    return true;
+}
+
+bool SpoolWriter::Close(void)
+{
+    int result = close(m_Fd);
+    m_Fd = -1;
+
+    return (result == 0);
+}
+
+void SpoolWriter::Discard(void)
+{
+    if (m_Fd != -1)
+    {
+        close(m_Fd);
+        m_Fd = -1;
+    }
+
+    if (!m_Path.empty())
+    {
+        unlink(m_Path.c_str());
+        m_Path.clear();
+    }
+
+    m_Size = 0;
+}
+
+std::string SpoolWriter::Release(void)
+{
+    std::string path;
+    path.swap(m_Path);
+    m_Size = 0;
+
+    return path;
+}
+
+MappedFile::MappedFile(void)
+    : m_Data(nullptr), m_Length(0)
+{
+}
+
+MappedFile::~MappedFile(void)
+{
+    if (m_Data)
+        munmap(m_Data, m_Length);
+}
+
+bool MappedFile::Map(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        spdlog::error("Spool: unable to open {}: {}", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return false;
+    }
+
+    m_Length = static_cast<size_t>(st.st_size);
+    if (m_Length > 0)
+    {
+        // writable so that scripts may be handed the memory itself, the
+        // pages they change are copied and the spool file is left alone
+        void *data = mmap(nullptr, m_Length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            spdlog::error("Spool: unable to map {}: {}", path.c_str(), strerror(errno));
+            close(fd);
+            m_Length = 0;
+            return false;
+        }
+
+        // the message is read front to back
+        madvise(data, m_Length, MADV_SEQUENTIAL);
+        m_Data = static_cast<char*>(data);
+    }
+    else
+        m_Data = nullptr;
+
+    close(fd);
+    return true;
+}
+
+bool PrepareSpool(const std::string &dir)
+{
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        spdlog::warn("Spool: unable to create {}: {}", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (access(dir.c_str(), W_OK | X_OK) == -1)
+    {
+        spdlog::warn("Spool: {} is not writable", dir.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void CleanSpool(const std::string &dir, const std::set<std::string> &keep)
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (strncmp(entry->d_name, SPOOL_PREFIX, strlen(SPOOL_PREFIX)) == 0)
+        {
+            std::string path(dir);
+            path.append("/").append(entry->d_name);
+            if (keep.count(path) > 0)
+                continue;
+
+            spdlog::debug("Spool: removing stale file {}", path.c_str());
+            unlink(path.c_str());
+        }
+    }
+
+    closedir(d);
+}
@@ -0,0 +1,80 @@
+// smtp-js-http
+
+// Copyright (c) 2020 James Kinnaird
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstddef>
+#include <set>
+#include <string>
+
+// Streams a message being received into a file in the spool directory
+class SpoolWriter
+{
+private:
+    int m_Fd;
+    std::string m_Path;
+    size_t m_Size;
+
+public:
+    SpoolWriter(void);
+    ~SpoolWriter(void);
+
+    bool Open(const std::string &dir);
+    bool Write(const char *data, size_t len);
+    bool Close(void);
+
+    // close and remove the file, e.g. when the transaction is aborted
+    void Discard(void);
+
+    // hand the closed file over to the caller, returns its path
+    std::string Release(void);
+
+    bool IsOpen(void) const { return m_Fd != -1; }
+    const std::string& Path(void) const { return m_Path; }
+    size_t Size(void) const { return m_Size; }
+};
+
+// Private mapping of a spooled message. Writes to it are copy-on-write and
+// never reach the file
+class MappedFile
+{
+private:
+    char *m_Data;
+    size_t m_Length;
+
+public:
+    MappedFile(void);
+    ~MappedFile(void);
+
+    bool Map(const std::string &path);
+
+    const char* Data(void) const { return m_Data; }
+    char* Data(void) { return m_Data; }
+    size_t Length(void) const { return m_Length; }
+};
+
+// makes sure the spool directory exists, returns false if it can't be used
+bool PrepareSpool(const std::string &dir);
+
+// remove spooled messages left behind by a previous run, other than those
+// in 'keep'
+void CleanSpool(const std::string &dir, const std::set<std::string> &keep);
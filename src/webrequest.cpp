@@ -21,29 +21,177 @@
 // SOFTWARE.
 
 #include "webrequest.hpp"
+#include "breaker.hpp"
+#include "fiber.hpp"
+#include "httpengine.hpp"
+#include "metrics.hpp"
+#include "retry.hpp"
 #include "spdlog/spdlog.h"
+#include <algorithm>
+#include <mutex>
 #include <sstream>
+#include <vector>
 
-size_t WriteCallback(char *ptr, size_t size, size_t mem, void *param)
+// idle handles kept per thread, for scripts that use several at once
+#define HANDLE_POOL_SIZE    4
+
+
+// shared by the handles of every worker, each kind of data with its own lock
+static CURLSH *s_Share = nullptr;
+static std::mutex s_ShareLocks[CURL_LOCK_DATA_LAST];
+static HttpOptions s_Options;
+
+static HttpEngine *s_Engine = nullptr;
+
+// where the engine reports the requests this thread started, and the
+// context they are started in
+static thread_local HttpEngine::Inbox t_Inbox;
+static thread_local RequestContext t_Default;
+static thread_local RequestContext *t_Context = nullptr;
+
+static void ShareLock(CURL *curl, curl_lock_data data, curl_lock_access access, void *param)
+{
+    s_ShareLocks[data].lock();
+}
+
+static void ShareUnlock(CURL *curl, curl_lock_data data, void *param)
+{
+    s_ShareLocks[data].unlock();
+}
+
+// Curl handles of a worker thread that are not in use. A handle keeps its
+// connections and TLS sessions open, so handing it to the next WebRequest
+// lets requests to the same host skip the connect and handshake.
+class HandlePool
 {
-	size_t totalbytes = size * mem;
-	ptr[totalbytes] = '\0';	// null terminate the returned data
+private:
+    std::vector<CURL*> m_Idle;
+
+public:
+    ~HandlePool(void)
+    {
+        for (std::vector<CURL*>::iterator i = m_Idle.begin(); i != m_Idle.end(); ++i)
+            curl_easy_cleanup((*i));
+    }
+
+    CURL* Take(void)
+    {
+        static std::atomic<int64_t> &created = Metrics::Counter("smtp_js_http_http_handles_created_total",
+            "Curl handles created for web requests");
+        static std::atomic<int64_t> &reused = Metrics::Counter("smtp_js_http_http_handles_reused_total",
+            "Web requests that reused a pooled curl handle");
+
+        if (m_Idle.empty())
+        {
+            created++;
+
+            // a handle stays attached to the share through resets
+            CURL *curl = curl_easy_init();
+            if (curl && s_Share)
+                curl_easy_setopt(curl, CURLOPT_SHARE, s_Share);
+            return curl;
+        }
+
+        reused++;
+        CURL *curl = m_Idle.back();
+        m_Idle.pop_back();
+        return curl;
+    }
+
+    // the options are reset, the connections stay open
+    void Give(CURL *curl)
+    {
+        if (m_Idle.size() >= HANDLE_POOL_SIZE)
+        {
+            curl_easy_cleanup(curl);
+            return;
+        }
+
+        curl_easy_reset(curl);
+        m_Idle.push_back(curl);
+    }
+};
+
+static thread_local HandlePool t_Handles;
+
+// the host and port a URL goes to, empty if it can't be parsed
+static std::string HostOf(const std::string &url)
+{
+    std::string result;
+
+    CURLU *parsed = curl_url();
+    if (parsed == nullptr)
+        return result;
+
+    char *host = nullptr;
+    char *port = nullptr;
+    if (curl_url_set(parsed, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK)
+        result.append(host).append(":").append(port);
+
+    curl_free(host);
+    curl_free(port);
+    curl_url_cleanup(parsed);
+
+    return result;
+}
+
+// called by the engine thread with each chunk of the response body
+size_t WebRequest::Write(char *ptr, size_t size, size_t mem, void *param)
+{
+    WebRequest *request = static_cast<WebRequest*>(param);
+    size_t length = size * mem;
+    if (!request->m_Keep)
+        return length;
+
+    std::string &result = request->m_Result;
+    if (s_Options.maxResponse > 0 && result.size() + length > s_Options.maxResponse)
+    {
+        // anything other than 'length' aborts the transfer
+        request->m_TooLarge = true;
+        return 0;
+    }
 
-	std::string *str = static_cast<std::string*>(param);
-	if (str)
-		str->assign(ptr);
+    // allocated once up front when the server says how much is coming
+    if (result.empty())
+    {
+        curl_off_t expected = -1;
+        if (curl_easy_getinfo(request->m_Curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &expected) == CURLE_OK
+            && expected > 0)
+        {
+            size_t reserve = static_cast<size_t>(expected);
+            if (s_Options.maxResponse > 0)
+                reserve = std::min(reserve, s_Options.maxResponse);
+            result.reserve(reserve);
+        }
+    }
 
-	return totalbytes;
+    result.append(ptr, length);
+    return length;
 }
 
 WebRequest::WebRequest(void)
 {
-    m_Curl = curl_easy_init();
+    m_Curl = t_Handles.Take();
     if (m_Curl)
     {
         curl_easy_setopt(m_Curl, CURLOPT_ERRORBUFFER, m_errorBuf);
-		curl_easy_setopt(m_Curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-		curl_easy_setopt(m_Curl, CURLOPT_WRITEDATA, &m_Result);
+        curl_easy_setopt(m_Curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(m_Curl, CURLOPT_DNS_CACHE_TIMEOUT, s_Options.dnsTtl);
+
+        // negotiated through ALPN. a request waits for a connection being
+        // set up to the same host rather than opening another, so that it
+        // can be a stream on it
+        if (s_Options.http2)
+        {
+            curl_easy_setopt(m_Curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+            curl_easy_setopt(m_Curl, CURLOPT_PIPEWAIT, 1L);
+        }
+        else
+            curl_easy_setopt(m_Curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+		curl_easy_setopt(m_Curl, CURLOPT_WRITEFUNCTION, Write);
+		curl_easy_setopt(m_Curl, CURLOPT_WRITEDATA, this);
 
 		std::ostringstream agent;
 		agent << "smtp-js-http;";
@@ -52,6 +200,18 @@ WebRequest::WebRequest(void)
     }
 
     m_Headers = nullptr;
+    m_Busy = false;
+    m_Async = false;
+    m_Post = false;
+    m_Keep = true;
+    m_TooLarge = false;
+    m_Retries = Context().retries;
+    m_Retrying = false;
+    m_Rejected = false;
+    m_Context = nullptr;
+    m_Code = CURLE_OK;
+    m_Status = 0;
+    m_RetryAfter = -1;
 }
 
 WebRequest::~WebRequest(void)
@@ -60,7 +220,7 @@ WebRequest::~WebRequest(void)
 		curl_slist_free_all(m_Headers);
         
     if (m_Curl)
-        curl_easy_cleanup(m_Curl);
+        t_Handles.Give(m_Curl);
 }
 
 void WebRequest::Header(const std::string &name, const std::string &value)
@@ -76,49 +236,310 @@ void WebRequest::PostData(const std::string &data)
     m_PostData.assign(data);
 }
 
-int32_t WebRequest::Get(const std::string &url)
+void WebRequest::SetKeepResult(bool keep)
 {
-    if (m_Curl)
-    {
-        curl_easy_setopt(m_Curl, CURLOPT_POST, 0);
-        return Perform(url);
-    }
+    // the engine thread reads it while a request is running
+    if (!m_Busy)
+        m_Keep = keep;
+}
+
+void WebRequest::SetTimeout(std::chrono::milliseconds timeout)
+{
+    if (m_Curl && !m_Busy)
+        curl_easy_setopt(m_Curl, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count()));
+}
 
-    return -1;
+int32_t WebRequest::Get(const std::string &url)
+{
+    return Perform(url, false);
 }
 
 int32_t WebRequest::Post(const std::string &url)
 {
-    if (m_Curl)
+    return Perform(url, true);
+}
+
+bool WebRequest::Prepare(const std::string &url, bool post)
+{
+    if (m_Curl == nullptr || m_Busy || s_Engine == nullptr)
+        return false;
+
+    m_Result.clear();
+    m_TooLarge = false;
+    m_Retrying = false;
+    m_Rejected = false;
+    m_Url = url;
+    m_Post = post;
+    m_Host.clear();
+    m_errorBuf[0] = '\0';
+
+    // turned away before any of the body is read if Content-Length is over
+    // the limit, otherwise Write() stops it once it gets there
+    curl_easy_setopt(m_Curl, CURLOPT_MAXFILESIZE_LARGE,
+        static_cast<curl_off_t>(m_Keep ? s_Options.maxResponse : 0));
+
+    if (post)
     {
         curl_easy_setopt(m_Curl, CURLOPT_POST, 1L);
         curl_easy_setopt(m_Curl, CURLOPT_POSTFIELDS, m_PostData.c_str());
         curl_easy_setopt(m_Curl, CURLOPT_POSTFIELDSIZE, -1L);
+    }
+    else
+        curl_easy_setopt(m_Curl, CURLOPT_HTTPGET, 1L);
+
+    if (m_Headers)
+        curl_easy_setopt(m_Curl, CURLOPT_HTTPHEADER, m_Headers);
 
-        return Perform(url);
+    curl_easy_setopt(m_Curl, CURLOPT_URL, url.c_str());
+    return true;
+}
+
+bool WebRequest::Start(const std::string &url, bool post)
+{
+    return Submit(url, post, true);
+}
+
+bool WebRequest::Submit(const std::string &url, bool post, bool async)
+{
+    if (!Prepare(url, post))
+        return false;
+
+    m_Busy = true;
+    m_Async = async;
+    m_Context = &Context();
+    m_Context->inFlight++;
+
+    bool breaker = (s_Options.breakers && s_Options.breakers->Enabled());
+    if (breaker || s_Options.limits)
+        m_Host = HostOf(url);
+
+    // while the host is down the request fails here, as if it couldn't
+    // connect, rather than waiting out a timeout
+    if (breaker && !m_Host.empty() && !s_Options.breakers->Allow(m_Host))
+    {
+        m_Rejected = true;
+        Dispatch(this, CURLE_COULDNT_CONNECT, nullptr);
+        return true;
     }
 
-    return -1;
+    s_Engine->Submit(m_Curl, this, t_Inbox, m_Host);
+    return true;
 }
 
-int32_t WebRequest::Perform(const std::string &url)
+int32_t WebRequest::Perform(const std::string &url, bool post)
 {
-    m_Result.clear();
+    if (!Submit(url, post, false))
+        return -1;
 
-    if (m_Headers)
-        curl_easy_setopt(m_Curl, CURLOPT_HTTPHEADER, m_Headers);
+    // requests started earlier may finish first, they are kept for
+    // NextFinished()
+    while (m_Busy)
+        Wait(*m_Context);
+
+    // the retry queue has it now, so to the script it went through
+    return (m_Retrying ? 0 : m_Code);
+}
+
+void WebRequest::Finish(CURLcode result)
+{
+    m_Busy = false;
+    m_Code = result;
+    m_Context->inFlight--;
+
+    m_Status = 0;
+    m_RetryAfter = -1;
+    if (!m_Rejected)
+    {
+        curl_easy_getinfo(m_Curl, CURLINFO_RESPONSE_CODE, &m_Status);
+
+        curl_off_t retryAfter = 0;
+        if (curl_easy_getinfo(m_Curl, CURLINFO_RETRY_AFTER, &retryAfter) == CURLE_OK && retryAfter > 0)
+            m_RetryAfter = static_cast<long>(retryAfter);
+
+        // a response that was too big says nothing about the host
+        if (!m_Host.empty() && s_Options.breakers && s_Options.breakers->Enabled())
+        {
+            curl_off_t total = 0;
+            curl_easy_getinfo(m_Curl, CURLINFO_TOTAL_TIME_T, &total);
+
+            bool bad = (result != CURLE_OK && result != CURLE_WRITE_ERROR &&
+                result != CURLE_FILESIZE_EXCEEDED) || m_Status >= 500;
+            s_Options.breakers->Record(m_Host, bad, std::chrono::milliseconds(total / 1000));
+        }
+    }
+
+    // the retry queue owns it from here, so the script hasn't failed
+    bool failed = (result != CURLE_OK || m_Status >= 400);
+    if (failed && m_Retries > 0 && RetryQueue::IsRetryable(result, m_Status))
+        m_Retrying = HandOver();
 
-    curl_easy_setopt(m_Curl, CURLOPT_URL, url.c_str());
-    CURLcode result = curl_easy_perform(m_Curl);
     if (result == CURLE_OK)
     {
         m_Error.clear();
-        return 0;
+        if (failed && !m_Retrying)
+            m_Context->failures++;
     }
     else
     {
-        m_Error.assign(m_errorBuf);
+        if (m_TooLarge || result == CURLE_FILESIZE_EXCEEDED)
+        {
+            static std::atomic<int64_t> &tooLarge = Metrics::Counter("smtp_js_http_http_responses_too_large_total",
+                "Web requests aborted because the response was over http-max-response");
+            tooLarge++;
+
+            m_Result.clear();
+            m_Error.assign("Response larger than " + std::to_string(s_Options.maxResponse) + " bytes");
+        }
+        else if (m_Rejected)
+            m_Error.assign("Circuit breaker for " + m_Host + " is open");
+        else
+            m_Error.assign(m_errorBuf[0] ? m_errorBuf : curl_easy_strerror(result));
+
+        if (!m_Retrying)
+            m_Context->failures++;
     }
-        
-    return result;
+}
+
+bool WebRequest::HandOver(void)
+{
+    if (s_Options.retries == nullptr)
+        return false;
+
+    RetryItem item;
+    item.url = m_Url;
+    item.post = m_Post;
+    if (m_Post)
+        item.data = m_PostData;
+    for (struct curl_slist *header = m_Headers; header; header = header->next)
+        item.headers.push_back(header->data);
+    item.attempt = 1;
+    item.attempts = m_Retries + 1;
+
+    return s_Options.retries->Add(item, m_RetryAfter);
+}
+
+RequestContext& WebRequest::Context(void)
+{
+    return (t_Context ? *t_Context : t_Default);
+}
+
+void WebRequest::SetContext(RequestContext *context)
+{
+    t_Context = context;
+}
+
+void WebRequest::Dispatch(WebRequest *request, CURLcode result, std::vector<RequestContext*> *ready)
+{
+    RequestContext *context = request->m_Context;
+    request->Finish(result);
+    if (request->m_Async)
+        context->finished.push_back(request);
+
+    if (ready && std::find(ready->begin(), ready->end(), context) == ready->end())
+        ready->push_back(context);
+}
+
+void WebRequest::Wait(RequestContext &context)
+{
+    // a script in a fiber is resumed once Collect() has something for it
+    if (Fiber::Current())
+    {
+        Fiber::Yield();
+        return;
+    }
+
+    std::vector<std::pair<void*, CURLcode>> done;
+    t_Inbox.Wait(done);
+    for (std::vector<std::pair<void*, CURLcode>>::iterator i = done.begin(); i != done.end(); ++i)
+        Dispatch(static_cast<WebRequest*>(i->first), i->second, nullptr);
+}
+
+void WebRequest::Collect(std::chrono::milliseconds timeout, std::vector<RequestContext*> &ready)
+{
+    std::vector<std::pair<void*, CURLcode>> done;
+    if (!t_Inbox.Wait(done, timeout))
+        return;
+
+    for (std::vector<std::pair<void*, CURLcode>>::iterator i = done.begin(); i != done.end(); ++i)
+        Dispatch(static_cast<WebRequest*>(i->first), i->second, &ready);
+}
+
+bool WebRequest::NextFinished(WebRequest *&request)
+{
+    RequestContext &context = Context();
+    while (context.finished.empty())
+    {
+        if (context.inFlight == 0)
+            return false;
+
+        Wait(context);
+    }
+
+    request = context.finished.front();
+    context.finished.pop_front();
+    return true;
+}
+
+bool WebRequest::TakeFinished(WebRequest *&request)
+{
+    RequestContext &context = Context();
+    if (context.finished.empty())
+        return false;
+
+    request = context.finished.front();
+    context.finished.pop_front();
+    return true;
+}
+
+bool WebRequest::Init(const HttpOptions &options)
+{
+    s_Options = options;
+
+    s_Share = curl_share_init();
+    if (s_Share == nullptr)
+        return false;
+
+    curl_share_setopt(s_Share, CURLSHOPT_LOCKFUNC, ShareLock);
+    curl_share_setopt(s_Share, CURLSHOPT_UNLOCKFUNC, ShareUnlock);
+    curl_share_setopt(s_Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(s_Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    // older versions of libcurl can't share connections, they are then
+    // only reused by the handles of each worker
+    if (curl_share_setopt(s_Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+        spdlog::warn("WebRequest: libcurl can't share connections between workers");
+
+    s_Engine = new HttpEngine(options.limits);
+    return s_Engine->Start(options.http2);
+}
+
+void WebRequest::Cleanup(void)
+{
+    if (s_Engine)
+    {
+        s_Engine->Stop();
+        delete s_Engine;
+        s_Engine = nullptr;
+    }
+
+    if (s_Share)
+    {
+        curl_share_cleanup(s_Share);
+        s_Share = nullptr;
+    }
+}
+
+void WebRequest::ResetFailures(void)
+{
+    Context().failures = 0;
+}
+
+unsigned int WebRequest::Failures(void)
+{
+    return Context().failures;
+}
+
+void WebRequest::SetDefaultRetries(unsigned int retries)
+{
+    Context().retries = retries;
 }
\ No newline at end of file
@@ -22,8 +22,43 @@
 
 #pragma once
 
+#include <chrono>
 #include <curl/curl.h>
+#include <deque>
 #include <string>
+#include <vector>
+
+class Breakers;
+class HostLimits;
+class RetryQueue;
+class WebRequest;
+
+// The web requests of one script run: how many are in flight, those
+// started asynchronously that have finished, and how many failed. A script
+// run in a Fiber has its own, and gives way while it waits for them.
+struct RequestContext
+{
+    size_t inFlight;
+    std::deque<WebRequest*> finished;
+    unsigned int failures;
+    unsigned int retries;       // for the requests made from now on
+
+    RequestContext(void) : inFlight(0), failures(0), retries(0) {}
+};
+
+// Settings shared by every web request
+struct HttpOptions
+{
+    long dnsTtl;                // seconds resolved host names are cached for
+    bool http2;                 // offer HTTP/2 to HTTPS endpoints
+    size_t maxResponse;         // larger response bodies fail, 0 for no limit
+    RetryQueue *retries;        // takes over failed requests, if set
+    Breakers *breakers;         // fails requests to hosts that are down, if set
+    HostLimits *limits;         // holds requests to each host to its limits, if set
+
+    HttpOptions(void) : dnsTtl(60), http2(false), maxResponse(0), retries(nullptr), breakers(nullptr),
+        limits(nullptr) {}
+};
 
 class WebRequest
 {
@@ -31,12 +66,27 @@ private:
     CURL *m_Curl;
     char m_errorBuf[CURL_ERROR_SIZE * 2];
 
+    std::string m_Url;
+    std::string m_Host;         // name:port, if breakers or limits need it
+    bool m_Post;
     std::string m_PostData;
     std::string m_Error;
     std::string m_Result;
 
     struct curl_slist *m_Headers;
 
+    bool m_Busy;                // handed to the engine
+    bool m_Async;
+    bool m_Keep;                // the response body is stored for Result()
+    bool m_TooLarge;
+    unsigned int m_Retries;     // further attempts if it fails
+    bool m_Retrying;            // failed and handed to the retry queue
+    bool m_Rejected;            // failed without being sent, its host's breaker is open
+    RequestContext *m_Context;  // the one it was started in
+    CURLcode m_Code;
+    long m_Status;
+    long m_RetryAfter;
+
 public:
     WebRequest(void);
     ~WebRequest(void);
@@ -47,9 +97,76 @@ public:
     int32_t Get(const std::string &url);
     int32_t Post(const std::string &url);
 
+    // starts the request without waiting for it. false if it couldn't be,
+    // otherwise it is returned by NextFinished() once done
+    bool Start(const std::string &url, bool post);
+
+    // a request started in the current context that has finished, waiting
+    // for one if need be. false once none are left in flight
+    static bool NextFinished(WebRequest *&request);
+
+    // the same without waiting. false if none has finished
+    static bool TakeFinished(WebRequest *&request);
+
+    // the context requests are started in from now on, on this thread.
+    // nullptr for the thread's own
+    static void SetContext(RequestContext *context);
+
+    // waits up to 'timeout' for requests started on this thread to finish,
+    // and adds the contexts that were suspended waiting for them to 'ready'
+    static void Collect(std::chrono::milliseconds timeout, std::vector<RequestContext*> &ready);
+
     std::string Result(void) const { return m_Result; }
+
+    // whether the response body is kept. without it the body is read and
+    // dropped as it arrives, for requests whose result is never looked at
+    bool KeepResult(void) const { return m_Keep; }
+    void SetKeepResult(bool keep);
+
+    // how many more times the request is sent, through the RetryQueue, if
+    // it fails in a way that may pass. it then counts as handled rather
+    // than failed, and Retrying() is true
+    unsigned int Retries(void) const { return m_Retries; }
+    void SetRetries(unsigned int retries) { m_Retries = retries; }
+    bool Retrying(void) const { return m_Retrying; }
+
+    // gives up on a request that takes longer than 'timeout'
+    void SetTimeout(std::chrono::milliseconds timeout);
+
+    CURLcode Code(void) const { return m_Code; }
+    bool Rejected(void) const { return m_Rejected; }
+    long Status(void) const { return m_Status; }
+
+    // seconds the server asked to be left alone for, -1 if it didn't
+    long RetryAfter(void) const { return m_RetryAfter; }
     std::string Error(void) const { return m_Error; }
 
+    // requests in the current context that failed or got an HTTP error
+    // status since the last reset
+    static void ResetFailures(void);
+    static unsigned int Failures(void);
+
+    // retries for the requests made in the current context from now on
+    static void SetDefaultRetries(unsigned int retries);
+
+    // sets up the DNS cache, TLS sessions and connections shared by every
+    // request and starts the engine that runs them. with 'http2', HTTPS
+    // requests offer HTTP/2 and those to the same host share a connection.
+    // call once after curl_global_init, and Cleanup() once no requests are
+    // left
+    static bool Init(const HttpOptions &options);
+    static void Cleanup(void);
+
 private:
-    int32_t Perform(const std::string &url);
+    int32_t Perform(const std::string &url, bool post);
+    bool Prepare(const std::string &url, bool post);
+    bool Submit(const std::string &url, bool post, bool async);
+    void Finish(CURLcode result);
+    bool HandOver(void);
+
+    static size_t Write(char *ptr, size_t size, size_t mem, void *param);
+
+    static RequestContext& Context(void);
+    static void Wait(RequestContext &context);
+    static void Dispatch(WebRequest *request, CURLcode result, std::vector<RequestContext*> *ready);
 };